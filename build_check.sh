@@ -0,0 +1 @@
+g++ syb_check.cpp -o syb_check -O1 -pthread `/usr/local/bin/Magick++-config --cppflags --cxxflags --ldflags --libs` `pkg-config --cflags --libs freetype2` && ./syb_check
\ No newline at end of file
@@ -0,0 +1 @@
+gcc syb_client.c -o syb_render -O2 -DSAYOBOT_CLIENT_MAIN
\ No newline at end of file
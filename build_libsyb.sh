@@ -1 +1 @@
-g++ syb.cpp -o libsyb.so -shared -fPIC -O3 `/usr/local/bin/Magick++-config --cppflags --cxxflags --ldflags --libs`
\ No newline at end of file
+g++ syb.cpp -o libsyb.so -shared -fPIC -O3 -pthread `/usr/local/bin/Magick++-config --cppflags --cxxflags --ldflags --libs` `pkg-config --cflags --libs freetype2`
\ No newline at end of file
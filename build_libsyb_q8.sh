@@ -0,0 +1 @@
+g++ syb.cpp -o libsyb_q8.so -shared -fPIC -O3 -pthread -DSAYOBOT_Q8 `/usr/local/magick-q8/bin/Magick++-config --cppflags --cxxflags --ldflags --libs` -Wl,-rpath,/usr/local/magick-q8/lib `pkg-config --cflags --libs freetype2`
\ No newline at end of file
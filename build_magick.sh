@@ -4,4 +4,9 @@ sudo apt-get install libjpeg-dev
 cd ImageMagick
 ./configure
 make
-sudo make install
\ No newline at end of file
+sudo make install
+# Q8、非HDRI 的版本（libsyb_q8.so 使用），安装到单独的目录，不影响上面的默认版本
+make distclean
+./configure --with-quantum-depth=8 --disable-hdri --prefix=/usr/local/magick-q8
+make
+sudo make install
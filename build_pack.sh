@@ -0,0 +1 @@
+g++ syb_pack.cpp -o syb_pack -O3 -pthread `/usr/local/bin/Magick++-config --cppflags --cxxflags --ldflags --libs` `pkg-config --cflags --libs freetype2`
\ No newline at end of file
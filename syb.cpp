@@ -1,32 +1,3104 @@
 #ifndef WIN32
     #define sprintfS(buffer, length, format, ...) sprintf(buffer, format, __VA_ARGS__)
+    #define localtimeS(tm, tt) localtime_r(tt, tm)
+    #define popcount64 __builtin_popcountll
 #else
 	#define sprintfS sprintf_s
+    #define localtimeS(tm, tt) localtime_s(tm, tt)
+    #define strcasecmp _stricmp
+    #define popcount64 __popcnt64
 #endif
 
 #include <math.h>
+#include <stdlib.h>
+#include <string.h>
 #include <sys/stat.h>
 #include <time.h>
+#ifndef WIN32
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#else
+#include <io.h>
+#endif
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <fstream>
+#include <functional>
+#include <future>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <random>
+#include <regex>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <type_traits>
+#include <unordered_map>
+#include <vector>
+
+// x86 上用 GCC/Clang 的 target 属性编译 SIMD 版本，运行时按CPU选择
+#if (defined(__GNUC__) || defined(__clang__)) && (defined(__x86_64__) || defined(__i386__))
+#define SAYOBOT_X86_SIMD
+#include <immintrin.h>
+#endif
+
+// 定义 SAYOBOT_Q8 时按 Q8、非HDRI 的 ImageMagick 编译（见 build_libsyb_q8.sh）
+#ifndef WIN32
+#ifdef SAYOBOT_Q8
+#define MAGICKCORE_QUANTUM_DEPTH 8
+#ifndef MAGICKCORE_HDRI_ENABLE
+#define MAGICKCORE_HDRI_ENABLE 0
+#endif
+#else
+#define MAGICKCORE_QUANTUM_DEPTH 16
+#ifndef MAGICKCORE_HDRI_ENABLE
+#define MAGICKCORE_HDRI_ENABLE TRUE
+#endif
+#endif
+#endif
+#include <Magick++.h>
+#include <random>
+#include <string>
+
+#include <ft2build.h>
+#include FT_FREETYPE_H
+#include FT_OUTLINE_H
+
+namespace Sayobot
+{
+    /*
+     * 渲染各阶段的耗时（纳秒），按线程累计
+     * 用于性能测试：渲染前 Reset，渲染后读取 ns[]
+     */
+    struct StageTimes {
+        enum Stage { Decode = 0, Resize, Composite, Text, Encode, Count };
+
+        uint64_t ns[Count];
+
+        void Reset()
+        {
+            for (int i = 0; i < Count; ++i)
+                this->ns[i] = 0;
+        }
+
+        static const char* Name(int stage)
+        {
+            static const char* names[] = {"decode", "resize", "composite", "text", "encode"};
+            return names[stage];
+        }
+
+        // 当前线程的统计
+        static StageTimes& Current()
+        {
+            static thread_local StageTimes times = StageTimes();
+            return times;
+        }
+    };
+
+    // 在作用域内计时，结束时累加到当前线程的 StageTimes
+    class StageTimer {
+    public:
+        explicit StageTimer(StageTimes::Stage stage)
+            : stage(stage), start(std::chrono::steady_clock::now())
+        {
+        }
+
+        ~StageTimer()
+        {
+            StageTimes::Current().ns[this->stage] +=
+                std::chrono::duration_cast<std::chrono::nanoseconds>(
+                    std::chrono::steady_clock::now() - this->start)
+                    .count();
+        }
+
+    private:
+        StageTimes::Stage stage;
+        std::chrono::steady_clock::time_point start;
+    };
+
+    /*
+     * 延迟直方图（微秒）
+     * 第0个桶统计小于1微秒的次数，第i个桶统计 [2^(i-1), 2^i) 微秒的次数，
+     * 最后一个桶还包含所有更慢的
+     */
+    struct Histogram {
+        static const int Buckets = 24;
+
+        std::atomic<uint64_t> count, sum_us, buckets[Buckets];
+
+        Histogram()
+        {
+            this->Reset();
+        }
+
+        void Add(uint64_t us)
+        {
+            int bucket = 0;
+            while (bucket < Buckets - 1 && us >= (1ULL << bucket))
+                ++bucket;
+            ++this->count;
+            this->sum_us += us;
+            ++this->buckets[bucket];
+        }
+
+        void Reset()
+        {
+            this->count = 0;
+            this->sum_us = 0;
+            for (int i = 0; i < Buckets; ++i)
+                this->buckets[i] = 0;
+        }
+    };
+
+    /*
+     * 进程内的运行统计，所有上下文共用
+     * 由导出函数 Sayobot_GetStats / Sayobot_ResetStats 读取和清零
+     */
+    struct Metrics {
+        std::atomic<uint64_t> cards_rendered, cards_failed;
+        Histogram render, drawpic, drawtext, save;
+        std::atomic<uint64_t> asset_hits, asset_misses, layer_hits, layer_misses,
+            glyph_hits, glyph_misses, bytes_decoded;
+        std::atomic<int64_t> canvas_bytes;
+        std::atomic<int64_t> peak_canvas_bytes;
+
+        Metrics() : canvas_bytes(0)
+        {
+            this->Reset();
+        }
+
+        // 清零所有统计，正在使用的画布内存除外（峰值重置为当前值）
+        void Reset()
+        {
+            this->cards_rendered = this->cards_failed = 0;
+            this->render.Reset();
+            this->drawpic.Reset();
+            this->drawtext.Reset();
+            this->save.Reset();
+            this->asset_hits = this->asset_misses = 0;
+            this->layer_hits = this->layer_misses = 0;
+            this->glyph_hits = this->glyph_misses = 0;
+            this->bytes_decoded = 0;
+            this->peak_canvas_bytes = this->canvas_bytes.load();
+        }
+
+        void AddCanvas(int64_t bytes)
+        {
+            const int64_t now = this->canvas_bytes += bytes;
+            int64_t peak = this->peak_canvas_bytes.load();
+            while (now > peak && !this->peak_canvas_bytes.compare_exchange_weak(peak, now))
+            {
+            }
+        }
+
+        static Metrics& Global()
+        {
+            static Metrics instance;
+            return instance;
+        }
+    };
+
+    // 在作用域内计时，结束时记录到直方图
+    class MetricTimer {
+    public:
+        explicit MetricTimer(Histogram& histogram)
+            : histogram(histogram), start(std::chrono::steady_clock::now())
+        {
+        }
+
+        ~MetricTimer()
+        {
+            this->histogram.Add(std::chrono::duration_cast<std::chrono::microseconds>(
+                                    std::chrono::steady_clock::now() - this->start)
+                                    .count());
+        }
+
+    private:
+        Histogram& histogram;
+        std::chrono::steady_clock::time_point start;
+    };
+
+    /*
+     * 记录画布占用的内存，随 Image 一起复制和析构
+     * 复制的 Image 与原来的共享像素（写时复制），也共享同一份记录，只计一次；
+     * 换成新的像素（包括复制出自己的一份）时调用 Set
+     * Magick 画布在 Magick 内部因修改而复制时不会单独计数
+     */
+    class CanvasAccount {
+    public:
+        void Set(int64_t bytes)
+        {
+            if (this->charge && this->charge.use_count() == 1 && this->charge->bytes == bytes)
+                return;
+            this->charge = bytes ? std::make_shared<Charge>(bytes) : nullptr;
+        }
+
+    private:
+        // 一块像素的记录，最后一个共享它的 Image 析构时减去
+        struct Charge {
+            explicit Charge(int64_t bytes) : bytes(bytes)
+            {
+                Metrics::Global().AddCanvas(bytes);
+            }
+
+            ~Charge()
+            {
+                Metrics::Global().AddCanvas(-this->bytes);
+            }
+
+            int64_t bytes;
+        };
+
+        std::shared_ptr<Charge> charge;
+    };
+
+    /*
+     * 按字节预算淘汰的LRU缓存（线程安全）
+     * 超出预算时从最久未使用的项目开始淘汰，单个超出预算的项目不会被缓存
+     */
+    template <typename Key, typename Value, typename Hash = std::hash<Key>>
+    class LruCache {
+    public:
+        explicit LruCache(size_t capacity = 0) : capacity(capacity), used(0)
+        {
+        }
+
+        bool Get(const Key& key, Value& value)
+        {
+            std::lock_guard<std::mutex> lock(this->mutex);
+            auto it = this->index.find(key);
+            if (it == this->index.end())
+                return false;
+            this->items.splice(this->items.begin(), this->items, it->second);
+            value = it->second->value;
+            return true;
+        }
+
+        void Put(const Key& key, const Value& value, size_t bytes)
+        {
+            std::lock_guard<std::mutex> lock(this->mutex);
+            auto it = this->index.find(key);
+            if (it != this->index.end())
+            {
+                this->used -= it->second->bytes;
+                this->items.erase(it->second);
+                this->index.erase(it);
+            }
+            if (bytes > this->capacity)
+                return;
+            this->items.push_front(Entry{key, value, bytes});
+            this->index[key] = this->items.begin();
+            this->used += bytes;
+            this->Evict();
+        }
+
+        void SetCapacity(size_t bytes)
+        {
+            std::lock_guard<std::mutex> lock(this->mutex);
+            this->capacity = bytes;
+            this->Evict();
+        }
+
+        size_t Capacity() const
+        {
+            std::lock_guard<std::mutex> lock(this->mutex);
+            return this->capacity;
+        }
+
+        size_t Used() const
+        {
+            std::lock_guard<std::mutex> lock(this->mutex);
+            return this->used;
+        }
+
+        void Clear()
+        {
+            std::lock_guard<std::mutex> lock(this->mutex);
+            this->items.clear();
+            this->index.clear();
+            this->used = 0;
+        }
+
+    private:
+        struct Entry {
+            Key key;
+            Value value;
+            size_t bytes;
+        };
+
+        void Evict()
+        {
+            while (this->used > this->capacity && !this->items.empty())
+            {
+                this->used -= this->items.back().bytes;
+                this->index.erase(this->items.back().key);
+                this->items.pop_back();
+            }
+        }
+
+        std::list<Entry> items;
+        std::unordered_map<Key, typename std::list<Entry>::iterator, Hash> index;
+        size_t capacity, used;
+        mutable std::mutex mutex;
+    };
+
+    /*
+     * 快速的非加密64位哈希，每次混合8个字节
+     * 用于内容寻址的文件名和缓存键，不能用于安全相关的场合
+     */
+    class Hasher {
+    public:
+        Hasher() : state(0x9E3779B97F4A7C15ULL), length(0), tail(0), tail_bytes(0)
+        {
+        }
+
+        void Update(const void* data, size_t size)
+        {
+            const unsigned char* p = (const unsigned char*)data;
+            this->length += size;
+            while (size && this->tail_bytes)
+            {
+                this->PushByte(*p++);
+                --size;
+            }
+            for (; size >= 8; p += 8, size -= 8)
+            {
+                uint64_t word;
+                memcpy(&word, p, 8);
+                this->state = Mix(this->state, word);
+            }
+            while (size--)
+                this->PushByte(*p++);
+        }
+
+        // 数值类型按内存表示加入
+        template <typename T>
+        void Add(const T& value)
+        {
+            static_assert(std::is_arithmetic<T>::value || std::is_enum<T>::value,
+                          "Hasher::Add only accepts arithmetic values");
+            this->Update(&value, sizeof(value));
+        }
+
+        // 字符串连同长度一起加入，NULL与空字符串不同
+        void Add(const char* str)
+        {
+            const uint64_t size = str ? strlen(str) : ~0ULL;
+            this->Add(size);
+            if (str)
+                this->Update(str, (size_t)size);
+        }
+
+        void Add(char* str)
+        {
+            this->Add((const char*)str);
+        }
+
+        void Add(const std::string& str)
+        {
+            this->Add((uint64_t)str.size());
+            this->Update(str.data(), str.size());
+        }
+
+        uint64_t Digest() const
+        {
+            uint64_t h = Mix(this->state, this->tail ^ this->length);
+            h ^= h >> 30;
+            h *= 0xBF58476D1CE4E5B9ULL;
+            h ^= h >> 27;
+            h *= 0x94D049BB133111EBULL;
+            h ^= h >> 31;
+            return h;
+        }
+
+        std::string HexDigest() const
+        {
+            char buf[17];
+            sprintfS(buf, 17, "%016llx", (unsigned long long)this->Digest());
+            return buf;
+        }
+
+        static uint64_t Hash(const void* data, size_t size)
+        {
+            Hasher hasher;
+            hasher.Update(data, size);
+            return hasher.Digest();
+        }
+
+    private:
+        static uint64_t Mix(uint64_t h, uint64_t word)
+        {
+            word *= 0x87C37B91114253D5ULL;
+            word = word << 31 | word >> 33;
+            word *= 0x4CF5AD432745937FULL;
+            h ^= word;
+            h = h << 27 | h >> 37;
+            return h * 5 + 0x52DCE729;
+        }
+
+        void PushByte(unsigned char byte)
+        {
+            this->tail |= (uint64_t)byte << (8 * this->tail_bytes);
+            if (++this->tail_bytes == 8)
+            {
+                this->state = Mix(this->state, this->tail);
+                this->tail = 0;
+                this->tail_bytes = 0;
+            }
+        }
+
+        uint64_t state, length, tail;
+        int tail_bytes;
+    };
+
+    /*
+     * 编译时选择的 Magick 像素格式：默认 Q16 HDRI（浮点），SAYOBOT_Q8 时为 Q8
+     * 与量子深度有关的计算都经由这里，两个版本由同一份代码编译
+     */
+    struct QuantumTraits {
+        static const int Depth = MAGICKCORE_QUANTUM_DEPTH;
+        static const bool Hdri = std::is_floating_point<Magick::Quantum>::value;
+
+        // 每个通道占用的字节
+        static size_t Bytes()
+        {
+            return sizeof(Magick::Quantum);
+        }
+
+        // "Q8"、"Q16-HDRI" 等
+        static const char* Name()
+        {
+            static const std::string name =
+                "Q" + std::to_string(Depth) + (Hdri ? "-HDRI" : "");
+            return name.c_str();
+        }
+
+        // 量子值转为8位，HDRI 的值可能超出范围，需要截断
+        static uint8_t ToChar(double quantum)
+        {
+            const double value = quantum * 255.0 / MagickCore::QuantumRange + 0.5;
+            return value <= 0 ? 0 : value >= 255 ? 255 : (uint8_t)value;
+        }
+    };
+
+    /*
+     * 预乘alpha的8位RGBA画布，每个像素按 R, G, B, A 四个字节紧密排列
+     * 复制时共享像素（与 Magick::Image 一样），修改前用 Unique 判断是否需要 Clone
+     */
+    class Raster {
+    public:
+        Raster() : width(0), height(0), owned(true)
+        {
+        }
+
+        // 全透明的画布
+        Raster(size_t width, size_t height)
+            : width(width), height(height),
+              storage(new uint8_t[width * height * 4](), std::default_delete<uint8_t[]>()),
+              owned(true)
+        {
+        }
+
+        // 引用外部的只读像素（例如映射到内存的素材包），owner 保证像素在此期间有效
+        static Raster View(size_t width, size_t height, const uint8_t* pixels,
+                           const std::shared_ptr<const void>& owner)
+        {
+            Raster raster;
+            raster.width = width;
+            raster.height = height;
+            raster.storage = std::shared_ptr<uint8_t>(std::const_pointer_cast<void>(owner),
+                                                      const_cast<uint8_t*>(pixels));
+            raster.owned = false;
+            return raster;
+        }
+
+        size_t Width() const
+        {
+            return this->width;
+        }
+
+        size_t Height() const
+        {
+            return this->height;
+        }
+
+        size_t Bytes() const
+        {
+            return this->width * this->height * 4;
+        }
+
+        bool Empty() const
+        {
+            return !this->storage;
+        }
+
+        // 独占且可以修改（不是 View）
+        bool Unique() const
+        {
+            return this->owned && this->storage.use_count() == 1;
+        }
+
+        uint8_t* Row(size_t y)
+        {
+            return this->storage.get() + y * this->width * 4;
+        }
+
+        const uint8_t* Row(size_t y) const
+        {
+            return this->storage.get() + y * this->width * 4;
+        }
+
+        Raster Clone() const
+        {
+            Raster copy(this->width, this->height);
+            if (this->storage)
+                memcpy(copy.storage.get(), this->storage.get(), this->Bytes());
+            return copy;
+        }
+
+        // 输出未预乘的RGBA像素，out 至少为 Bytes() 字节
+        void Export(uint8_t* out) const
+        {
+            const uint8_t* p = this->storage.get();
+            for (size_t i = 0; i < this->width * this->height; ++i, p += 4, out += 4)
+            {
+                const uint32_t a = p[3];
+                for (int c = 0; c < 3; ++c)
+                    out[c] = a == 255 ? p[c]
+                             : a ? (uint8_t)std::min<uint32_t>(255, (p[c] * 255 + a / 2) / a)
+                                 : 0;
+                out[3] = (uint8_t)a;
+            }
+        }
+
+        static Raster FromMagick(const Magick::Image& image)
+        {
+            Raster raster(image.columns(), image.rows());
+            if (!raster.Bytes())
+                return raster;
+            uint8_t* p = raster.storage.get();
+            Magick::Image source(image); // write 不是 const 的，复制只增加引用计数
+            source.write(
+                0, 0, raster.width, raster.height, "RGBA", MagickCore::CharPixel, p);
+            for (size_t i = 0; i < raster.width * raster.height; ++i, p += 4)
+            {
+                const uint32_t a = p[3];
+                if (a == 255)
+                    continue;
+                for (int c = 0; c < 3; ++c)
+                    p[c] = Div255(p[c] * a);
+            }
+            return raster;
+        }
+
+        Magick::Image ToMagick() const
+        {
+            Magick::Image image;
+            if (!this->Bytes())
+                return image;
+            std::vector<uint8_t> pixels(this->Bytes());
+            this->Export(&pixels[0]);
+            image.read(this->width, this->height, "RGBA", MagickCore::CharPixel, &pixels[0]);
+            return image;
+        }
+
+        // x / 255 四舍五入，x 不超过 255 * 255
+        static uint8_t Div255(uint32_t x)
+        {
+            x += 128;
+            return (uint8_t)((x + (x >> 8)) >> 8);
+        }
+
+    private:
+        size_t width, height;
+        std::shared_ptr<uint8_t> storage;
+        bool owned;
+    };
+
+    /*
+     * 预乘RGBA8的 Over 合成：dst = src + dst * (255 - src.a) / 255
+     * 运行时按CPU选择 AVX2 / SSE4.1 / 标量实现，三者的结果逐字节相同
+     */
+    class Compositor {
+    public:
+        // 将 src 合成到 dst 的 (x, y) 处，超出 dst 的部分被裁掉
+        static void Over(Raster& dst, const Raster& src, ssize_t x, ssize_t y)
+        {
+            const ssize_t x0 = std::max<ssize_t>(x, 0), y0 = std::max<ssize_t>(y, 0);
+            const ssize_t x1 = std::min<ssize_t>(x + (ssize_t)src.Width(), dst.Width());
+            const ssize_t y1 = std::min<ssize_t>(y + (ssize_t)src.Height(), dst.Height());
+            if (x0 >= x1 || y0 >= y1)
+                return;
+            const RowKernel kernel = Kernel();
+            for (ssize_t row = y0; row < y1; ++row)
+                kernel(dst.Row(row) + x0 * 4, src.Row(row - y) + (x0 - x) * 4, x1 - x0);
+        }
+
+        // 当前使用的实现："avx2"、"sse4.1" 或 "scalar"
+        static const char* KernelName()
+        {
+#ifdef SAYOBOT_X86_SIMD
+            if (Kernel() == OverRowAVX2)
+                return "avx2";
+            if (Kernel() == OverRowSSE41)
+                return "sse4.1";
+#endif
+            return "scalar";
+        }
+
+    private:
+        typedef void (*RowKernel)(uint8_t*, const uint8_t*, size_t);
+
+        static RowKernel Kernel()
+        {
+            static const RowKernel kernel = SelectKernel();
+            return kernel;
+        }
+
+        static RowKernel SelectKernel()
+        {
+#ifdef SAYOBOT_X86_SIMD
+            __builtin_cpu_init();
+            if (__builtin_cpu_supports("avx2"))
+                return OverRowAVX2;
+            if (__builtin_cpu_supports("sse4.1"))
+                return OverRowSSE41;
+#endif
+            return OverRowScalar;
+        }
+
+        static void OverRowScalar(uint8_t* d, const uint8_t* s, size_t n)
+        {
+            for (; n; --n, d += 4, s += 4)
+            {
+                const uint32_t sa = s[3];
+                if (sa == 255)
+                    memcpy(d, s, 4);
+                else if (sa)
+                {
+                    for (int c = 0; c < 4; ++c)
+                        d[c] = (uint8_t)(s[c] + Raster::Div255(d[c] * (255 - sa)));
+                }
+            }
+        }
+
+#ifdef SAYOBOT_X86_SIMD
+        // 每次4个像素：alpha广播到各通道，扩展为16位相乘后用与 Div255 相同的方式除以255
+        __attribute__((target("sse4.1"))) static void OverRowSSE41(uint8_t* d,
+                                                                   const uint8_t* s,
+                                                                   size_t n)
+        {
+            const __m128i alpha =
+                _mm_setr_epi8(3, 3, 3, 3, 7, 7, 7, 7, 11, 11, 11, 11, 15, 15, 15, 15);
+            const __m128i zero = _mm_setzero_si128(), ones = _mm_set1_epi8(-1);
+            const __m128i bias = _mm_set1_epi16(128);
+            for (; n >= 4; n -= 4, d += 16, s += 16)
+            {
+                const __m128i src = _mm_loadu_si128((const __m128i*)s);
+                const __m128i a = _mm_shuffle_epi8(src, alpha);
+                if (_mm_movemask_epi8(_mm_cmpeq_epi8(a, ones)) == 0xFFFF)
+                {
+                    _mm_storeu_si128((__m128i*)d, src);
+                    continue;
+                }
+                if (_mm_testz_si128(a, a))
+                    continue;
+                const __m128i inv = _mm_xor_si128(a, ones);
+                const __m128i dst = _mm_loadu_si128((const __m128i*)d);
+                __m128i lo = _mm_mullo_epi16(_mm_unpacklo_epi8(dst, zero),
+                                             _mm_unpacklo_epi8(inv, zero));
+                __m128i hi = _mm_mullo_epi16(_mm_unpackhi_epi8(dst, zero),
+                                             _mm_unpackhi_epi8(inv, zero));
+                lo = _mm_add_epi16(lo, bias);
+                hi = _mm_add_epi16(hi, bias);
+                lo = _mm_srli_epi16(_mm_add_epi16(lo, _mm_srli_epi16(lo, 8)), 8);
+                hi = _mm_srli_epi16(_mm_add_epi16(hi, _mm_srli_epi16(hi, 8)), 8);
+                _mm_storeu_si128((__m128i*)d, _mm_adds_epu8(src, _mm_packus_epi16(lo, hi)));
+            }
+            OverRowScalar(d, s, n);
+        }
+
+        // 与 SSE4.1 相同，每次8个像素（unpack 和 pack 都在128位的半边内进行）
+        __attribute__((target("avx2"))) static void OverRowAVX2(uint8_t* d,
+                                                                const uint8_t* s,
+                                                                size_t n)
+        {
+            const __m256i alpha =
+                _mm256_setr_epi8(3, 3, 3, 3, 7, 7, 7, 7, 11, 11, 11, 11, 15, 15, 15, 15,
+                                 3, 3, 3, 3, 7, 7, 7, 7, 11, 11, 11, 11, 15, 15, 15, 15);
+            const __m256i zero = _mm256_setzero_si256(), ones = _mm256_set1_epi8(-1);
+            const __m256i bias = _mm256_set1_epi16(128);
+            for (; n >= 8; n -= 8, d += 32, s += 32)
+            {
+                const __m256i src = _mm256_loadu_si256((const __m256i*)s);
+                const __m256i a = _mm256_shuffle_epi8(src, alpha);
+                if (_mm256_movemask_epi8(_mm256_cmpeq_epi8(a, ones)) == -1)
+                {
+                    _mm256_storeu_si256((__m256i*)d, src);
+                    continue;
+                }
+                if (_mm256_testz_si256(a, a))
+                    continue;
+                const __m256i inv = _mm256_xor_si256(a, ones);
+                const __m256i dst = _mm256_loadu_si256((const __m256i*)d);
+                __m256i lo = _mm256_mullo_epi16(_mm256_unpacklo_epi8(dst, zero),
+                                                _mm256_unpacklo_epi8(inv, zero));
+                __m256i hi = _mm256_mullo_epi16(_mm256_unpackhi_epi8(dst, zero),
+                                                _mm256_unpackhi_epi8(inv, zero));
+                lo = _mm256_add_epi16(lo, bias);
+                hi = _mm256_add_epi16(hi, bias);
+                lo = _mm256_srli_epi16(_mm256_add_epi16(lo, _mm256_srli_epi16(lo, 8)), 8);
+                hi = _mm256_srli_epi16(_mm256_add_epi16(hi, _mm256_srli_epi16(hi, 8)), 8);
+                _mm256_storeu_si256((__m256i*)d,
+                                    _mm256_adds_epu8(src, _mm256_packus_epi16(lo, hi)));
+            }
+            OverRowSSE41(d, s, n);
+        }
+#endif
+    };
+
+    /*
+     * 预处理好的素材包（由 syb_pack 生成）：已缩放、预乘的RGBA8像素，映射到内存后直接作为
+     * Raster 使用，不需要解码也不需要复制；多个进程映射同一个文件时共享页缓存
+     * 文件布局（小端）：Header | 像素数据（64字节对齐） | Entry[count]（按hash排序） | 名字
+     * 键为 (素材路径, 请求的宽, 请求的高)，与 AssetCache::LoadRaster 的参数一致；素材修改后需要重新打包
+     */
+    class AssetBundle : public std::enable_shared_from_this<AssetBundle> {
+    public:
+        struct Header {
+            char magic[8]; // "SYBPACK\0"
+            uint32_t version;
+            uint32_t count;
+            uint64_t index_offset;
+            uint64_t names_offset;
+            uint64_t file_size;
+        };
+
+        struct Entry {
+            uint64_t hash;   // Key(名字, key_width, key_height)
+            uint64_t offset; // 像素数据在文件中的位置
+            uint32_t name_offset, name_length;
+            uint32_t key_width, key_height; // 请求的尺寸，不缩放时为0
+            uint32_t width, height;         // 像素的实际尺寸（缩放时保持比例）
+        };
+
+        static const uint32_t Version = 1;
+
+        ~AssetBundle()
+        {
+#ifndef WIN32
+            if (this->data)
+                munmap((void*)this->data, this->size);
+#endif
+        }
+
+        AssetBundle(const AssetBundle&) = delete;
+        AssetBundle& operator=(const AssetBundle&) = delete;
+
+        // 打开素材包，文件不存在或格式不对时返回NULL
+        static std::shared_ptr<AssetBundle> Open(const std::string& path)
+        {
+            std::shared_ptr<AssetBundle> bundle(new AssetBundle());
+#ifndef WIN32
+            int fd = open(path.c_str(), O_RDONLY);
+            if (fd < 0)
+                return nullptr;
+            struct stat st;
+            void* p = MAP_FAILED;
+            if (fstat(fd, &st) == 0 && st.st_size >= (off_t)sizeof(Header))
+                p = mmap(nullptr, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+            close(fd);
+            if (p == MAP_FAILED)
+                return nullptr;
+            bundle->data = (const uint8_t*)p;
+            bundle->size = st.st_size;
+#else
+            std::ifstream file(path, std::ios::binary);
+            if (!file)
+                return nullptr;
+            bundle->buffer.assign(std::istreambuf_iterator<char>(file),
+                                  std::istreambuf_iterator<char>());
+            bundle->size = bundle->buffer.size();
+            bundle->data = bundle->buffer.data();
+#endif
+            return bundle->Validate() ? bundle : nullptr;
+        }
+
+        // 查找素材，找到时 raster 引用包中的像素
+        bool Find(const std::string& name, size_t width, size_t height, Raster& raster) const
+        {
+            const uint64_t hash = Key(name, width, height);
+            const Entry* it = std::lower_bound(
+                this->entries,
+                this->entries + this->count,
+                hash,
+                [](const Entry& entry, uint64_t hash) { return entry.hash < hash; });
+            for (; it != this->entries + this->count && it->hash == hash; ++it)
+            {
+                if (it->key_width == width && it->key_height == height
+                    && it->name_length == name.size()
+                    && !memcmp(this->names + it->name_offset, name.data(), name.size()))
+                {
+                    raster = Raster::View(
+                        it->width, it->height, this->data + it->offset, shared_from_this());
+                    return true;
+                }
+            }
+            return false;
+        }
+
+        size_t Size() const
+        {
+            return this->count;
+        }
+
+        static uint64_t Key(const std::string& name, size_t width, size_t height)
+        {
+            Hasher hasher;
+            hasher.Add(name);
+            hasher.Add((uint32_t)width);
+            hasher.Add((uint32_t)height);
+            return hasher.Digest();
+        }
+
+        static const char* Magic()
+        {
+            return "SYBPACK"; // 连同结尾的\0共8字节
+        }
+
+    private:
+        AssetBundle() : data(nullptr), size(0), entries(nullptr), names(nullptr), count(0)
+        {
+        }
+
+        // 检查文件头和每个项目的范围，保证之后的访问不会越界
+        bool Validate()
+        {
+            Header header;
+            memcpy(&header, this->data, sizeof(header));
+            if (memcmp(header.magic, Magic(), 8) || header.version != Version
+                || header.file_size != this->size || header.index_offset % 8
+                || header.index_offset > this->size
+                || (this->size - header.index_offset) / sizeof(Entry) < header.count
+                || header.names_offset > this->size)
+                return false;
+            this->entries = (const Entry*)(this->data + header.index_offset);
+            this->names = (const char*)(this->data + header.names_offset);
+            this->count = header.count;
+            const uint64_t names_size = this->size - header.names_offset;
+            for (size_t i = 0; i < this->count; ++i)
+            {
+                const Entry& entry = this->entries[i];
+                if ((uint64_t)entry.name_offset + entry.name_length > names_size
+                    || entry.offset > this->size
+                    || (uint64_t)entry.width * entry.height * 4 > this->size - entry.offset
+                    || (i && this->entries[i - 1].hash > entry.hash))
+                    return false;
+            }
+            return true;
+        }
+
+        const uint8_t* data;
+        size_t size;
+        const Entry* entries;
+        const char* names;
+        size_t count;
+        std::vector<uint8_t> buffer; // 不使用mmap的平台上读入内存
+    };
+
+    /*
+     * 追加写入的文件的只读映射，AvatarStore 和 StatStore 共用
+     * 文件变长后重新 Map 得到新的映射，引用旧映射的数据在用完之前仍然有效
+     */
+    class MappedFile {
+    public:
+        ~MappedFile()
+        {
+#ifndef WIN32
+            if (this->data && this->buffer.empty())
+                munmap((void*)this->data, this->size);
+#endif
+        }
+
+        // 映射文件的前 size 个字节，失败时返回NULL
+        static std::shared_ptr<MappedFile> Map(FILE* file, uint64_t size)
+        {
+            std::shared_ptr<MappedFile> map(new MappedFile());
+            map->size = (size_t)size;
+            if (!size)
+                return map;
+#ifndef WIN32
+            void* p = mmap(nullptr, map->size, PROT_READ, MAP_SHARED, fileno(file), 0);
+            if (p == MAP_FAILED)
+                return nullptr;
+            map->data = (const uint8_t*)p;
+#else
+            map->buffer.resize(map->size);
+            if (fseek(file, 0, SEEK_SET) != 0
+                || fread(map->buffer.data(), 1, map->size, file) != map->size)
+                return nullptr;
+            map->data = map->buffer.data();
+#endif
+            return map;
+        }
+
+        // 把写入的内容同步到磁盘
+        static bool Sync(FILE* file)
+        {
+            if (fflush(file) != 0)
+                return false;
+#ifndef WIN32
+            return fsync(fileno(file)) == 0;
+#else
+            return true;
+#endif
+        }
+
+        // 截掉 size 之后的内容（丢弃不完整或写入失败的记录）
+        static bool Truncate(FILE* file, uint64_t size)
+        {
+            if (fflush(file) != 0)
+                return false;
+#ifndef WIN32
+            return ftruncate(fileno(file), (off_t)size) == 0;
+#else
+            return _chsize_s(_fileno(file), (__int64)size) == 0;
+#endif
+        }
+
+        const uint8_t* Data() const
+        {
+            return this->data;
+        }
+
+        size_t Size() const
+        {
+            return this->size;
+        }
+
+    private:
+        MappedFile() : data(nullptr), size(0)
+        {
+        }
+
+        const uint8_t* data;
+        size_t size;
+        std::vector<uint8_t> buffer; // 不使用mmap的平台上读入内存
+    };
+
+    /*
+     * 头像库：按 osu 用户id 保存缩放好的头像（预乘的RGBA8），只在文件末尾追加
+     * 文件为 Header 之后的一串记录，每条记录是 Record 加上像素；
+     * 同一用户后出现的记录覆盖之前的，像素为空（0x0）的记录表示删除
+     * 打开时扫描一遍记录头建立 id -> 位置 的索引，之后查找为一次哈希表查找，
+     * 像素直接引用映射到内存的文件。更新头像时先写入并同步新记录，再修改索引，
+     * 所以崩溃只会留下末尾不完整的记录，下次打开时被截掉
+     * 被覆盖的记录占用的空间由 Compact 回收
+     * 可以被多个线程同时使用
+     */
+    class AvatarStore {
+    public:
+        struct Header {
+            char magic[8]; // "SYBAVAT\0"
+            uint32_t version;
+            uint32_t reserved;
+        };
+
+        struct Record {
+            int64_t user_id;
+            uint32_t width, height; // 0x0 表示删除
+            uint64_t reserved[2];
+        };
+
+        static const uint32_t Version = 1;
+        static const size_t Thumbnail = 350; // 卡片上头像的尺寸
+
+        ~AvatarStore()
+        {
+            if (this->file)
+                fclose(this->file);
+        }
+
+        AvatarStore(const AvatarStore&) = delete;
+        AvatarStore& operator=(const AvatarStore&) = delete;
+
+        // 打开头像库，不存在时创建；文件无法打开或格式不对时返回NULL
+        static std::shared_ptr<AvatarStore> Open(const std::string& path)
+        {
+            std::shared_ptr<AvatarStore> store(new AvatarStore(path));
+            store->file = fopen(path.c_str(), "r+b");
+            if (!store->file)
+                store->file = fopen(path.c_str(), "w+b");
+            if (!store->file || !store->Load())
+                return nullptr;
+            return store;
+        }
+
+        // 查找头像，没有时返回false；找到时 raster 引用库中的像素
+        bool Find(int64_t user_id, Raster& raster) const
+        {
+            std::lock_guard<std::mutex> lock(this->mutex);
+            auto it = this->index.find(user_id);
+            if (it == this->index.end())
+                return false;
+            Record record;
+            memcpy(&record, this->map->Data() + it->second, sizeof(record));
+            raster = Raster::View(record.width,
+                                  record.height,
+                                  this->map->Data() + it->second + sizeof(Record),
+                                  this->map);
+            return true;
+        }
+
+        /*
+         * 添加或替换用户的头像，返回是否成功
+         * 像素先追加到文件末尾并同步到磁盘，之后的 Find 才会返回新头像，
+         * 之前取得的旧头像仍然有效
+         */
+        bool Put(int64_t user_id, const Raster& avatar)
+        {
+            if (avatar.Empty())
+                return false;
+            std::lock_guard<std::mutex> lock(this->mutex);
+            return this->Append(user_id, &avatar);
+        }
+
+        // 解码图片并缩放成卡片上的尺寸后保存，文件不存在或无法解码时抛出Magick::Exception
+        bool Put(int64_t user_id, const std::string& path)
+        {
+            Magick::Image img;
+            img.read(path);
+            img.resize(Magick::Geometry(Thumbnail, Thumbnail));
+            return this->Put(user_id, Raster::FromMagick(img));
+        }
+
+        // 删除用户的头像，之后的 Find 返回false
+        bool Remove(int64_t user_id)
+        {
+            std::lock_guard<std::mutex> lock(this->mutex);
+            if (!this->index.count(user_id))
+                return true;
+            return this->Append(user_id, nullptr);
+        }
+
+        /*
+         * 只保留每个用户最新的头像，写入新文件后替换原文件，返回回收的字节数，失败时返回-1
+         * 替换期间的 Find 和之前取得的头像不受影响
+         */
+        int64_t Compact()
+        {
+            std::lock_guard<std::mutex> lock(this->mutex);
+            const std::string temp = this->path + ".compact";
+            FILE* out = fopen(temp.c_str(), "w+b");
+            if (!out)
+                return -1;
+            std::vector<std::pair<int64_t, uint64_t>> live(this->index.begin(),
+                                                          this->index.end());
+            std::sort(live.begin(), live.end());
+            Header header = NewHeader();
+            bool ok = fwrite(&header, sizeof(header), 1, out) == 1;
+            for (size_t i = 0; ok && i < live.size(); ++i)
+                ok = fwrite(this->map->Data() + live[i].second,
+                            RecordSize(this->map->Data() + live[i].second),
+                            1,
+                            out)
+                     == 1;
+            ok = ok && MappedFile::Sync(out);
+            if (fclose(out) != 0 || !ok)
+            {
+                remove(temp.c_str());
+                return -1;
+            }
+            // 先打开并索引新文件，成功后才替换原文件；失败时原来的文件、句柄和索引都不变
+            std::shared_ptr<AvatarStore> compacted = Open(temp);
+            if (!compacted || rename(temp.c_str(), this->path.c_str()) != 0)
+            {
+                remove(temp.c_str());
+                return -1;
+            }
+            const int64_t reclaimed = (int64_t)this->garbage;
+            std::swap(this->file, compacted->file); // 旧的句柄随 compacted 关闭
+            this->map = compacted->map;
+            this->index.swap(compacted->index);
+            this->garbage = compacted->garbage;
+            ++this->generation;
+            return reclaimed;
+        }
+
+        // 用户数
+        size_t Size() const
+        {
+            std::lock_guard<std::mutex> lock(this->mutex);
+            return this->index.size();
+        }
+
+        // 文件的大小
+        uint64_t Bytes() const
+        {
+            std::lock_guard<std::mutex> lock(this->mutex);
+            return this->map->Size();
+        }
+
+        // 被覆盖或删除的记录占用的字节数
+        uint64_t Garbage() const
+        {
+            std::lock_guard<std::mutex> lock(this->mutex);
+            return this->garbage;
+        }
+
+        // 用户头像的版本，每次 Put 或 Remove 后改变（没有头像时为0），用于输出缓存的键
+        uint64_t Revision(int64_t user_id) const
+        {
+            std::lock_guard<std::mutex> lock(this->mutex);
+            auto it = this->index.find(user_id);
+            return it == this->index.end() ? 0 : (this->generation << 48) | it->second;
+        }
+
+        static const char* Magic()
+        {
+            return "SYBAVAT"; // 连同结尾的\0共8字节
+        }
+
+    private:
+        explicit AvatarStore(const std::string& path)
+            : path(path), file(nullptr), garbage(0), generation(0)
+        {
+        }
+
+        static Header NewHeader()
+        {
+            Header header;
+            memset(&header, 0, sizeof(header));
+            memcpy(header.magic, Magic(), 8);
+            header.version = Version;
+            return header;
+        }
+
+        static size_t RecordSize(const uint8_t* record)
+        {
+            Record r;
+            memcpy(&r, record, sizeof(r));
+            return sizeof(Record) + (size_t)r.width * r.height * 4;
+        }
+
+        // 重新映射整个文件，Find 返回的头像持有旧的映射
+        bool Remap(uint64_t size)
+        {
+            std::shared_ptr<MappedFile> map = MappedFile::Map(this->file, size);
+            if (!map)
+                return false;
+            this->map = map;
+            return true;
+        }
+
+        // 读入文件头，扫描记录建立索引，截掉末尾不完整的记录
+        bool Load()
+        {
+            this->index.clear();
+            this->garbage = 0;
+            ++this->generation;
+            if (fseek(this->file, 0, SEEK_END) != 0)
+                return false;
+            uint64_t size = (uint64_t)ftell(this->file);
+            if (size < sizeof(Header))
+            {
+                // 新文件（或连文件头都没有写完）
+                Header header = NewHeader();
+                if (fseek(this->file, 0, SEEK_SET) != 0
+                    || fwrite(&header, sizeof(header), 1, this->file) != 1
+                    || !MappedFile::Sync(this->file))
+                    return false;
+                size = sizeof(Header);
+            }
+            if (!this->Remap(size))
+                return false;
+            Header header;
+            memcpy(&header, this->map->Data(), sizeof(header));
+            if (memcmp(header.magic, Magic(), 8) || header.version != Version)
+                return false;
+            uint64_t offset = sizeof(Header);
+            Record record;
+            while (size - offset >= sizeof(Record))
+            {
+                memcpy(&record, this->map->Data() + offset, sizeof(record));
+                if (record.width > 65535 || record.height > 65535
+                    || RecordSize(this->map->Data() + offset) > size - offset)
+                    break;
+                this->Index(record, offset);
+                offset += RecordSize(this->map->Data() + offset);
+            }
+            if (offset != size)
+                return MappedFile::Truncate(this->file, offset) && this->Remap(offset);
+            return true;
+        }
+
+        void Index(const Record& record, uint64_t offset)
+        {
+            auto it = this->index.find(record.user_id);
+            if (it != this->index.end())
+                this->garbage += RecordSize(this->map->Data() + it->second);
+            if (record.width && record.height)
+            {
+                this->index[record.user_id] = offset;
+            }
+            else
+            {
+                this->garbage += sizeof(Record);
+                if (it != this->index.end())
+                    this->index.erase(it);
+            }
+        }
+
+        // 追加一条记录（avatar为NULL时为删除），同步后更新映射和索引
+        bool Append(int64_t user_id, const Raster* avatar)
+        {
+            Record record;
+            memset(&record, 0, sizeof(record));
+            record.user_id = user_id;
+            if (avatar)
+            {
+                record.width = (uint32_t)avatar->Width();
+                record.height = (uint32_t)avatar->Height();
+            }
+            const uint64_t offset = this->map->Size();
+            bool ok = fseek(this->file, (long)offset, SEEK_SET) == 0
+                      && fwrite(&record, sizeof(record), 1, this->file) == 1;
+            if (ok && avatar)
+                ok = fwrite(avatar->Row(0), 1, avatar->Bytes(), this->file) == avatar->Bytes();
+            const uint64_t size = offset + sizeof(record) + (avatar ? avatar->Bytes() : 0);
+            if (!ok || !MappedFile::Sync(this->file) || !this->Remap(size))
+            {
+                // 写入失败时丢掉这条记录，保持文件和索引一致
+                MappedFile::Truncate(this->file, offset);
+                return false;
+            }
+            this->Index(record, offset);
+            return true;
+        }
+
+        std::string path;
+        FILE* file;
+        std::shared_ptr<MappedFile> map;
+        std::unordered_map<int64_t, uint64_t> index; // 用户id -> 最新记录的位置
+        uint64_t garbage;
+        uint64_t generation; // 每次 Compact 后增加，使 Revision 在位置重用时也会改变
+        mutable std::mutex mutex;
+    };
+
+    // StatStore 中一次快照的数值字段（浮点数按位保存），顺序即文件中列的顺序
+    enum StatColumn {
+        STAT_TIMESTAMP = 0,
+        STAT_TOTAL_SCORE,
+        STAT_RANKED_SCORE,
+        STAT_TOTAL_HIT,
+        STAT_ACCURACY, // double 的位
+        STAT_PP,       // float 的位
+        STAT_LEVEL,    // float 的位
+        STAT_GLOBAL_RANK,
+        STAT_COUNTRY_RANK,
+        STAT_PLAYCOUNT,
+        STAT_XH,
+        STAT_X,
+        STAT_SH,
+        STAT_S,
+        STAT_A,
+        STAT_DAYS,
+        STAT_COLUMNS
+    };
+
+    // 一个用户在某一时刻的数据
+    struct StatSnapshot {
+        int32_t user_id;
+        int64_t qq;
+        std::string username, country;
+        int64_t values[STAT_COLUMNS];
+    };
+
+    /*
+     * 用户数据快照的时间序列，一个模式一个文件，只在末尾追加
+     * 文件为 Header 之后的一串块，每块是同一用户按时间排列的若干快照：
+     * Block 之后依次是 qq、用户名、国家，然后按列保存各字段，
+     * 每列是与上一行之差的 zigzag 变长整数（第一行与0相差），每列前写上该列的字节数
+     * 内存中为每个用户保存按时间排列的块的位置，查找时二分块，再只解码需要的列
+     * 追加的块较小（一批中每个用户一块），Compact 把每个用户的快照合并成尽量大的块
+     * 可以被多个线程同时使用
+     */
+    class StatStore {
+    public:
+        struct Header {
+            char magic[8]; // "SYBSTAT\0"
+            uint32_t version;
+            uint32_t mode;
+        };
+
+        struct Block {
+            uint32_t magic; // BlockMagic
+            int32_t user_id;
+            uint32_t count;
+            uint32_t payload;       // Block 之后的字节数
+            int64_t first, last;    // 第一行和最后一行的时间戳
+            uint64_t checksum;      // 内容的 Hasher，打开时检查
+        };
+
+        static const uint32_t Version = 1;
+        static const uint32_t BlockMagic = 0x4B4C4253; // "SBLK"
+        static const uint32_t BlockRows = 256;         // Compact 后每块最多的行数
+
+        ~StatStore()
+        {
+            if (this->file)
+                fclose(this->file);
+        }
+
+        StatStore(const StatStore&) = delete;
+        StatStore& operator=(const StatStore&) = delete;
+
+        // 打开模式 mode 的快照文件，不存在时创建；文件无法打开或格式不对时返回NULL
+        static std::shared_ptr<StatStore> Open(const std::string& path, uint32_t mode)
+        {
+            std::shared_ptr<StatStore> store(new StatStore(path, mode));
+            store->file = fopen(path.c_str(), "r+b");
+            if (!store->file)
+                store->file = fopen(path.c_str(), "w+b");
+            if (!store->file || !store->Load())
+                return nullptr;
+            return store;
+        }
+
+        // Append 的结果
+        enum AppendStatus { Appended = 0, Unordered, WriteFailed };
+
+        /*
+         * 追加快照并同步到磁盘
+         * 同一用户的快照要按时间追加，时间早于该用户最后一个快照时整批都不写入（Unordered）
+         */
+        AppendStatus Append(const std::vector<StatSnapshot>& snapshots)
+        {
+            StatStore* self = this;
+            return AppendAll(&self, &snapshots, 1);
+        }
+
+        /*
+         * 同时追加 n 个库（例如各个模式），batches[i] 追加到 stores[i]，stores 中不能有重复的库
+         * 先检查所有批次的时间顺序，再依次写入并同步，全部成功后才建立索引；
+         * 任何一个失败时已写入的库截回原来的大小，所有库都保持不变
+         */
+        static AppendStatus AppendAll(StatStore* const* stores,
+                                      const std::vector<StatSnapshot>* batches, size_t n)
+        {
+            // 多个库一起追加的调用方都按同样的顺序传入，依次加锁不会死锁
+            std::vector<std::unique_lock<std::mutex>> locks;
+            for (size_t i = 0; i < n; ++i)
+                locks.emplace_back(stores[i]->mutex);
+            for (size_t i = 0; i < n; ++i)
+            {
+                if (!stores[i]->Ordered(batches[i]))
+                    return Unordered;
+            }
+            std::vector<uint64_t> offsets(n);
+            std::vector<std::vector<std::pair<Block, uint64_t>>> written(n);
+            for (size_t i = 0; i < n; ++i)
+            {
+                offsets[i] = stores[i]->size;
+                if (!batches[i].empty() && !stores[i]->Write(batches[i], written[i]))
+                {
+                    for (size_t k = 0; k <= i; ++k)
+                        stores[k]->Truncate(offsets[k]);
+                    return WriteFailed;
+                }
+            }
+            for (size_t i = 0; i < n; ++i)
+            {
+                for (const auto& block : written[i])
+                    stores[i]->Index(block.first, block.second);
+            }
+            return Appended;
+        }
+
+        /*
+         * 查找用户在 timestamp 时（含）最近的一个快照，没有更早的快照时返回false
+         * timestamp 为 INT64_MAX 时即为最新的快照
+         */
+        bool Find(int32_t user_id, int64_t timestamp, StatSnapshot& out) const
+        {
+            std::shared_ptr<MappedFile> map;
+            uint64_t offset;
+            {
+                std::lock_guard<std::mutex> lock(this->mutex);
+                auto it = this->index.find(user_id);
+                if (it == this->index.end())
+                    return false;
+                const std::vector<BlockRef>& blocks = it->second;
+                auto block = std::upper_bound(
+                    blocks.begin(),
+                    blocks.end(),
+                    timestamp,
+                    [](int64_t timestamp, const BlockRef& ref) { return timestamp < ref.first; });
+                if (block == blocks.begin())
+                    return false;
+                offset = (block - 1)->offset;
+                map = this->Map();
+                if (!map)
+                    return false;
+            }
+            return Decode(map->Data() + offset, timestamp, out);
+        }
+
+        /*
+         * 把每个用户的快照合并成最多 BlockRows 行的块（用户名等改变时另起一块），
+         * 写入新文件后替换原文件，返回回收的字节数，失败时返回-1
+         */
+        int64_t Compact()
+        {
+            std::lock_guard<std::mutex> lock(this->mutex);
+            std::shared_ptr<MappedFile> map = this->Map();
+            if (!map)
+                return -1;
+            const std::string temp = this->path + ".compact";
+            FILE* out = fopen(temp.c_str(), "w+b");
+            if (!out)
+                return -1;
+            std::vector<int32_t> users;
+            for (const auto& user : this->index)
+                users.push_back(user.first);
+            std::sort(users.begin(), users.end());
+            Header header = this->NewHeader();
+            bool ok = fwrite(&header, sizeof(header), 1, out) == 1;
+            std::vector<std::pair<Block, uint64_t>> written;
+            for (size_t i = 0; ok && i < users.size(); ++i)
+            {
+                std::vector<StatSnapshot> rows;
+                for (const BlockRef& ref : this->index.at(users[i]))
+                    ok = ok && DecodeAll(map->Data() + ref.offset, rows);
+                if (!ok)
+                    break;
+                std::vector<const StatSnapshot*> group;
+                for (const StatSnapshot& row : rows)
+                    group.push_back(&row);
+                ok = this->WriteBlocks(out, group, written);
+            }
+            ok = ok && MappedFile::Sync(out);
+            if (fclose(out) != 0 || !ok)
+            {
+                remove(temp.c_str());
+                return -1;
+            }
+            // 先打开并索引新文件，成功后才替换原文件；失败时原来的文件、句柄和索引都不变
+            std::shared_ptr<StatStore> compacted = Open(temp, this->mode);
+            if (!compacted || rename(temp.c_str(), this->path.c_str()) != 0)
+            {
+                remove(temp.c_str());
+                return -1;
+            }
+            const int64_t before = (int64_t)this->size;
+            std::swap(this->file, compacted->file); // 旧的句柄随 compacted 关闭
+            this->size = compacted->size;
+            this->snapshots = compacted->snapshots;
+            this->map = compacted->map;
+            this->index.swap(compacted->index);
+            return before - (int64_t)this->size;
+        }
+
+        // 用户数
+        size_t Users() const
+        {
+            std::lock_guard<std::mutex> lock(this->mutex);
+            return this->index.size();
+        }
+
+        // 快照数
+        uint64_t Snapshots() const
+        {
+            std::lock_guard<std::mutex> lock(this->mutex);
+            return this->snapshots;
+        }
+
+        // 文件的大小
+        uint64_t Bytes() const
+        {
+            std::lock_guard<std::mutex> lock(this->mutex);
+            return this->size;
+        }
+
+        static const char* Magic()
+        {
+            return "SYBSTAT"; // 连同结尾的\0共8字节
+        }
+
+    private:
+        struct BlockRef {
+            int64_t first, last;
+            uint64_t offset;
+        };
+
+        StatStore(const std::string& path, uint32_t mode)
+            : path(path), mode(mode), file(nullptr), size(0), snapshots(0)
+        {
+        }
+
+        Header NewHeader() const
+        {
+            Header header;
+            memset(&header, 0, sizeof(header));
+            memcpy(header.magic, Magic(), 8);
+            header.version = Version;
+            header.mode = this->mode;
+            return header;
+        }
+
+        static void PutVarint(std::string& out, uint64_t value)
+        {
+            while (value >= 0x80)
+            {
+                out += (char)(value | 0x80);
+                value >>= 7;
+            }
+            out += (char)value;
+        }
+
+        static bool GetVarint(const uint8_t*& p, const uint8_t* end, uint64_t& value)
+        {
+            value = 0;
+            for (int shift = 0; p < end && shift < 64; shift += 7)
+            {
+                const uint8_t byte = *p++;
+                value |= (uint64_t)(byte & 0x7F) << shift;
+                if (!(byte & 0x80))
+                    return true;
+            }
+            return false;
+        }
+
+        static uint64_t ZigZag(int64_t value)
+        {
+            return ((uint64_t)value << 1) ^ (uint64_t)(value >> 63);
+        }
+
+        static int64_t UnZigZag(uint64_t value)
+        {
+            return (int64_t)(value >> 1) ^ -(int64_t)(value & 1);
+        }
+
+        static void PutString(std::string& out, const std::string& str)
+        {
+            PutVarint(out, str.size());
+            out += str;
+        }
+
+        static bool GetString(const uint8_t*& p, const uint8_t* end, std::string& str)
+        {
+            uint64_t length;
+            if (!GetVarint(p, end, length) || length > (uint64_t)(end - p))
+                return false;
+            str.assign((const char*)p, (size_t)length);
+            p += length;
+            return true;
+        }
+
+        // 同一用户的快照是否按时间排列且不早于该用户最后一个快照，调用时持有 mutex
+        bool Ordered(const std::vector<StatSnapshot>& snapshots) const
+        {
+            std::unordered_map<int32_t, int64_t> last;
+            for (const StatSnapshot& snapshot : snapshots)
+            {
+                auto it = last.find(snapshot.user_id);
+                if (it == last.end())
+                {
+                    auto blocks = this->index.find(snapshot.user_id);
+                    it = last.emplace(snapshot.user_id,
+                                      blocks == this->index.end() ? INT64_MIN
+                                                                  : blocks->second.back().last)
+                             .first;
+                }
+                if (snapshot.values[STAT_TIMESTAMP] < it->second)
+                    return false;
+                it->second = snapshot.values[STAT_TIMESTAMP];
+            }
+            return true;
+        }
+
+        /*
+         * 把快照写到文件末尾并同步，还不建立索引（由调用方在所有写入成功后进行）
+         * 失败时截回原来的大小；调用时持有 mutex
+         */
+        bool Write(const std::vector<StatSnapshot>& snapshots,
+                   std::vector<std::pair<Block, uint64_t>>& written)
+        {
+            // 同一用户的快照放在一块中，用户按第一次出现的顺序
+            std::vector<std::vector<const StatSnapshot*>> groups;
+            std::unordered_map<int32_t, size_t> group_of;
+            for (const StatSnapshot& snapshot : snapshots)
+            {
+                auto it = group_of.emplace(snapshot.user_id, groups.size()).first;
+                if (it->second == groups.size())
+                    groups.emplace_back();
+                groups[it->second].push_back(&snapshot);
+            }
+            const uint64_t offset = this->size;
+            bool ok = fseek(this->file, (long)offset, SEEK_SET) == 0;
+            for (size_t i = 0; ok && i < groups.size(); ++i)
+                ok = this->WriteBlocks(this->file, groups[i], written);
+            if (!ok || !MappedFile::Sync(this->file))
+            {
+                this->Truncate(offset);
+                return false;
+            }
+            return true;
+        }
+
+        // 丢弃 offset 之后还没有建立索引的块，调用时持有 mutex
+        void Truncate(uint64_t offset)
+        {
+            MappedFile::Truncate(this->file, offset);
+            this->size = offset;
+        }
+
+        /*
+         * 把一个用户的快照写成一个或多个块（超过 BlockRows 行或用户名等改变时另起一块）
+         * written 中记录写入的块和它们在文件中的位置
+         */
+        bool WriteBlocks(FILE* out,
+                         const std::vector<const StatSnapshot*>& rows,
+                         std::vector<std::pair<Block, uint64_t>>& written)
+        {
+            for (size_t begin = 0, end; begin < rows.size(); begin = end)
+            {
+                const StatSnapshot& head = *rows[begin];
+                for (end = begin + 1; end < rows.size() && end - begin < BlockRows
+                                      && rows[end]->qq == head.qq
+                                      && rows[end]->username == head.username
+                                      && rows[end]->country == head.country;
+                     ++end)
+                {
+                }
+                std::string payload, column;
+                PutVarint(payload, ZigZag(head.qq));
+                PutString(payload, head.username);
+                PutString(payload, head.country);
+                for (int c = 0; c < STAT_COLUMNS; ++c)
+                {
+                    column.clear();
+                    int64_t previous = 0;
+                    for (size_t i = begin; i < end; ++i)
+                    {
+                        const uint64_t delta = (uint64_t)rows[i]->values[c] - (uint64_t)previous;
+                        PutVarint(column, ZigZag((int64_t)delta));
+                        previous = rows[i]->values[c];
+                    }
+                    PutString(payload, column);
+                }
+                Block block;
+                memset(&block, 0, sizeof(block));
+                block.magic = BlockMagic;
+                block.user_id = head.user_id;
+                block.count = (uint32_t)(end - begin);
+                block.payload = (uint32_t)payload.size();
+                block.first = head.values[STAT_TIMESTAMP];
+                block.last = rows[end - 1]->values[STAT_TIMESTAMP];
+                Hasher hasher;
+                hasher.Update(payload.data(), payload.size());
+                block.checksum = hasher.Digest();
+                const uint64_t offset = (uint64_t)ftell(out);
+                if (fwrite(&block, sizeof(block), 1, out) != 1
+                    || fwrite(payload.data(), 1, payload.size(), out) != payload.size())
+                    return false;
+                if (out == this->file)
+                    this->size = offset + sizeof(block) + payload.size();
+                written.emplace_back(block, offset);
+            }
+            return true;
+        }
+
+        // 解码块中时间不晚于 timestamp 的最后一行
+        static bool Decode(const uint8_t* data, int64_t timestamp, StatSnapshot& out)
+        {
+            Block block;
+            memcpy(&block, data, sizeof(block));
+            const uint8_t* p = data + sizeof(block);
+            const uint8_t* end = p + block.payload;
+            uint64_t qq;
+            if (!GetVarint(p, end, qq) || !GetString(p, end, out.username)
+                || !GetString(p, end, out.country))
+                return false;
+            out.user_id = block.user_id;
+            out.qq = UnZigZag(qq);
+            // 先解码时间戳列确定行号，其余各列只解码到这一行
+            size_t row = 0;
+            for (int c = 0; c < STAT_COLUMNS; ++c)
+            {
+                uint64_t length, delta;
+                if (!GetVarint(p, end, length) || length > (uint64_t)(end - p))
+                    return false;
+                const uint8_t* q = p;
+                const uint8_t* column_end = p + length;
+                int64_t value = 0;
+                for (size_t i = 0; i < block.count; ++i)
+                {
+                    if (c != STAT_TIMESTAMP && i > row)
+                        break;
+                    if (!GetVarint(q, column_end, delta))
+                        return false;
+                    const int64_t next = (int64_t)((uint64_t)value + (uint64_t)UnZigZag(delta));
+                    if (c == STAT_TIMESTAMP && i && next > timestamp)
+                        break;
+                    value = next;
+                    row = c == STAT_TIMESTAMP ? i : row;
+                }
+                out.values[c] = value;
+                p = column_end;
+            }
+            return true;
+        }
+
+        // 解码块中的所有行，追加到 rows；数据损坏时返回false，rows 保持不变
+        static bool DecodeAll(const uint8_t* data, std::vector<StatSnapshot>& rows)
+        {
+            Block block;
+            memcpy(&block, data, sizeof(block));
+            const uint8_t* p = data + sizeof(block);
+            const uint8_t* end = p + block.payload;
+            StatSnapshot head = StatSnapshot();
+            uint64_t qq;
+            if (!GetVarint(p, end, qq) || !GetString(p, end, head.username)
+                || !GetString(p, end, head.country))
+                return false;
+            head.user_id = block.user_id;
+            head.qq = UnZigZag(qq);
+            const size_t first = rows.size();
+            rows.resize(first + block.count, head);
+            for (int c = 0; c < STAT_COLUMNS; ++c)
+            {
+                uint64_t length, delta;
+                if (!GetVarint(p, end, length) || length > (uint64_t)(end - p))
+                {
+                    rows.resize(first);
+                    return false;
+                }
+                const uint8_t* column_end = p + length;
+                int64_t value = 0;
+                for (size_t i = 0; i < block.count; ++i)
+                {
+                    if (!GetVarint(p, column_end, delta))
+                    {
+                        rows.resize(first);
+                        return false;
+                    }
+                    value = (int64_t)((uint64_t)value + (uint64_t)UnZigZag(delta));
+                    rows[first + i].values[c] = value;
+                }
+                p = column_end;
+            }
+            return true;
+        }
+
+        // 覆盖整个文件的映射，追加之后第一次读取时才重新映射
+        std::shared_ptr<MappedFile> Map() const
+        {
+            if (!this->map || this->map->Size() != this->size)
+                this->map = MappedFile::Map(this->file, this->size);
+            return this->map;
+        }
+
+        void Index(const Block& block, uint64_t offset)
+        {
+            this->index[block.user_id].push_back(BlockRef{block.first, block.last, offset});
+            this->snapshots += block.count;
+        }
+
+        // 读入文件头，扫描并检查所有块建立索引，截掉末尾不完整的块
+        bool Load()
+        {
+            this->index.clear();
+            this->snapshots = 0;
+            this->map.reset();
+            if (fseek(this->file, 0, SEEK_END) != 0)
+                return false;
+            this->size = (uint64_t)ftell(this->file);
+            if (this->size < sizeof(Header))
+            {
+                Header header = this->NewHeader();
+                if (fseek(this->file, 0, SEEK_SET) != 0
+                    || fwrite(&header, sizeof(header), 1, this->file) != 1
+                    || !MappedFile::Sync(this->file))
+                    return false;
+                this->size = sizeof(Header);
+            }
+            std::shared_ptr<MappedFile> map = this->Map();
+            if (!map)
+                return false;
+            Header header;
+            memcpy(&header, map->Data(), sizeof(header));
+            if (memcmp(header.magic, Magic(), 8) || header.version != Version
+                || header.mode != this->mode)
+                return false;
+            uint64_t offset = sizeof(Header);
+            Block block;
+            while (this->size - offset >= sizeof(Block))
+            {
+                memcpy(&block, map->Data() + offset, sizeof(block));
+                if (block.magic != BlockMagic || !block.count
+                    || block.payload > this->size - offset - sizeof(Block))
+                    break;
+                Hasher hasher;
+                hasher.Update(map->Data() + offset + sizeof(Block), block.payload);
+                if (hasher.Digest() != block.checksum)
+                    break;
+                auto blocks = this->index.find(block.user_id);
+                if (blocks != this->index.end() && blocks->second.back().last > block.first)
+                    break;
+                this->Index(block, offset);
+                offset += sizeof(Block) + block.payload;
+            }
+            if (offset != this->size)
+            {
+                if (!MappedFile::Truncate(this->file, offset))
+                    return false;
+                this->size = offset;
+            }
+            return true;
+        }
+
+        std::string path;
+        uint32_t mode;
+        FILE* file;
+        uint64_t size;
+        uint64_t snapshots;
+        mutable std::shared_ptr<MappedFile> map;
+        std::unordered_map<int32_t, std::vector<BlockRef>> index; // 用户id -> 按时间排列的块
+        mutable std::mutex mutex;
+    };
+
+    // 素材缓存的键：路径 + 文件修改时间 + 目标尺寸 + 缩放滤镜
+    struct AssetKey {
+        std::string path;
+        int64_t mtime;
+        size_t width, height;
+        bool raster;
+        MagickCore::FilterType filter;
+
+        bool operator==(const AssetKey& rhs) const
+        {
+            return mtime == rhs.mtime && width == rhs.width && height == rhs.height
+                   && raster == rhs.raster && filter == rhs.filter && path == rhs.path;
+        }
+    };
+
+    struct AssetKeyHash {
+        size_t operator()(const AssetKey& key) const
+        {
+            Hasher hasher;
+            hasher.Add(key.path);
+            hasher.Add(key.mtime);
+            hasher.Add((uint64_t)key.width);
+            hasher.Add((uint64_t)key.height);
+            hasher.Add((uint32_t)key.raster);
+            hasher.Add((uint32_t)key.filter);
+            return (size_t)hasher.Digest();
+        }
+    };
+
+    /*
+     * 已解码（并已缩放）素材的缓存
+     * 文件修改后mtime变化，旧的项目自然失效并被LRU淘汰
+     */
+    class AssetCache {
+    public:
+        explicit AssetCache(size_t capacity = 256 << 20) : cache(capacity)
+        {
+        }
+
+        /*
+         * 读取素材，命中缓存时直接返回共享的像素（Magick::Image为引用计数）
+         * 参数列表:
+         *** path (const std::string&) 图片路径
+         *** 可选 width 重新调整图片宽度
+         *** 可选 height 重新调整图片高度
+         *** 可选 filter 缩放使用的滤镜，默认由 Magick 决定
+         * 文件不存在或无法解码时与直接read一样抛出Magick::Exception
+         */
+        Magick::Image Load(const std::string& path, size_t width = 0,
+                           size_t height = 0,
+                           MagickCore::FilterType filter = MagickCore::UndefinedFilter)
+        {
+            Asset asset;
+            this->Fetch(path, width, height, filter, false, asset);
+            return asset.image;
+        }
+
+        // 与 Load 相同，但返回（并缓存）预乘的RGBA8像素，供 Compositor 使用
+        Raster LoadRaster(const std::string& path, size_t width = 0, size_t height = 0,
+                          MagickCore::FilterType filter = MagickCore::UndefinedFilter)
+        {
+            Asset asset;
+            this->Fetch(path, width, height, filter, true, asset);
+            return asset.raster;
+        }
+
+        void SetCapacity(size_t bytes)
+        {
+            this->cache.SetCapacity(bytes);
+        }
+
+        size_t Capacity() const
+        {
+            return this->cache.Capacity();
+        }
+
+        // 已缓存的素材占用的字节
+        size_t Used() const
+        {
+            return this->cache.Used();
+        }
+
+        void Clear()
+        {
+            this->cache.Clear();
+        }
+
+        /*
+         * 设置素材包，LoadRaster 先在包中查找（不访问文件，也不检查mtime），为NULL时不使用
+         * 可以在其他线程渲染时调用
+         */
+        void SetBundle(const std::shared_ptr<AssetBundle>& bundle)
+        {
+            std::atomic_store(&this->bundle, bundle);
+        }
+
+        std::shared_ptr<AssetBundle> Bundle() const
+        {
+            return std::atomic_load(&this->bundle);
+        }
+
+        /*
+         * 素材的原尺寸，不解码像素：素材包中有原尺寸的项目时直接取得，
+         * 否则只读取文件头（ping），结果按路径和修改时间记住
+         * 文件不存在或无法识别时抛出Magick::Exception
+         */
+        void NativeSize(const std::string& path, size_t& width, size_t& height) const
+        {
+            Raster native;
+            std::shared_ptr<AssetBundle> bundle = this->Bundle();
+            if (bundle && bundle->Find(path, 0, 0, native))
+            {
+                width = native.Width();
+                height = native.Height();
+                return;
+            }
+            struct stat st;
+            const int64_t mtime = stat(path.c_str(), &st) == 0 ? (int64_t)st.st_mtime : -1;
+            {
+                std::lock_guard<std::mutex> lock(this->sizes_mutex);
+                auto it = this->sizes.find(path);
+                if (it != this->sizes.end() && it->second.mtime == mtime)
+                {
+                    width = it->second.width;
+                    height = it->second.height;
+                    return;
+                }
+            }
+            Magick::Image img;
+            img.ping(path);
+            width = img.columns();
+            height = img.rows();
+            std::lock_guard<std::mutex> lock(this->sizes_mutex);
+            if (this->sizes.size() >= 65536)
+                this->sizes.clear();
+            this->sizes[path] = NativeGeometry{mtime, width, height};
+        }
+
+        // 估算解码后图片占用的内存（按RGBA四通道计算）
+        static size_t ImageBytes(const Magick::Image& img)
+        {
+            return img.columns() * img.rows() * 4 * QuantumTraits::Bytes();
+        }
+
+        // 进程内共享的素材缓存
+        static AssetCache& Global()
+        {
+            static AssetCache instance;
+            return instance;
+        }
+
+    private:
+        // 缓存的素材，按键的 raster 决定保存哪一种像素
+        struct Asset {
+            Magick::Image image;
+            Raster raster;
+        };
+
+        void Fetch(const std::string& path, size_t width, size_t height,
+                   MagickCore::FilterType filter, bool raster, Asset& asset)
+        {
+            if (!(width && height))
+            {
+                width = height = 0;
+                filter = MagickCore::UndefinedFilter;
+            }
+            if (raster && filter == MagickCore::UndefinedFilter)
+            {
+                std::shared_ptr<AssetBundle> bundle = this->Bundle();
+                if (bundle && bundle->Find(path, width, height, asset.raster))
+                {
+                    ++Metrics::Global().asset_hits;
+                    return;
+                }
+            }
+            struct stat st;
+            if (stat(path.c_str(), &st) != 0)
+            {
+                StageTimer timer(StageTimes::Decode);
+                asset.image.read(path);
+                if (raster)
+                    asset.raster = Raster::FromMagick(asset.image);
+                return;
+            }
+            AssetKey key{path, (int64_t)st.st_mtime, width, height, raster, filter};
+            if (this->cache.Get(key, asset))
+            {
+                ++Metrics::Global().asset_hits;
+                return;
+            }
+            ++Metrics::Global().asset_misses;
+            Magick::Image img;
+            {
+                StageTimer timer(StageTimes::Decode);
+                img.read(path);
+            }
+            Metrics::Global().bytes_decoded += ImageBytes(img);
+            if (width && height)
+            {
+                StageTimer timer(StageTimes::Resize);
+                if (filter != MagickCore::UndefinedFilter)
+                    img.filterType(filter);
+                img.resize(Magick::Geometry(width, height));
+            }
+            if (raster)
+            {
+                StageTimer timer(StageTimes::Decode);
+                asset.raster = Raster::FromMagick(img);
+                this->cache.Put(key, asset, asset.raster.Bytes());
+            }
+            else
+            {
+                asset.image = img;
+                this->cache.Put(key, asset, ImageBytes(img));
+            }
+        }
+
+        // NativeSize 记住的原尺寸
+        struct NativeGeometry {
+            int64_t mtime;
+            size_t width, height;
+        };
+
+        LruCache<AssetKey, Asset, AssetKeyHash> cache;
+        std::shared_ptr<AssetBundle> bundle;
+        mutable std::unordered_map<std::string, NativeGeometry> sizes;
+        mutable std::mutex sizes_mutex;
+    };
+
+    /*
+     * 预先合成好的底层画布缓存
+     * 键由组成底层的所有素材路径拼接而成，同时记录各素材的mtime，
+     * 命中时逐个stat校验，任一素材被修改则视为未命中
+     */
+    class LayerCache {
+    public:
+        typedef std::vector<std::pair<std::string, int64_t>> Dependencies;
+
+        explicit LayerCache(size_t capacity = 256 << 20) : cache(capacity)
+        {
+        }
+
+        // 获取底层，返回的像素与缓存共享，修改时才会复制
+        bool Get(const std::string& key, Magick::Image& image)
+        {
+            Layer layer;
+            if (!this->Lookup(key, layer, false))
+                return false;
+            image = layer.image;
+            return true;
+        }
+
+        bool Get(const std::string& key, Raster& raster)
+        {
+            Layer layer;
+            if (!this->Lookup(key, layer, true))
+                return false;
+            raster = layer.raster;
+            return true;
+        }
+
+        void Put(const std::string& key, const Magick::Image& image,
+                 const Dependencies& deps)
+        {
+            this->cache.Put(
+                key, Layer{image, Raster(), deps}, AssetCache::ImageBytes(image));
+        }
+
+        void Put(const std::string& key, const Raster& raster, const Dependencies& deps)
+        {
+            this->cache.Put(key, Layer{Magick::Image(), raster, deps}, raster.Bytes());
+        }
+
+        void SetCapacity(size_t bytes)
+        {
+            this->cache.SetCapacity(bytes);
+        }
+
+        size_t Capacity() const
+        {
+            return this->cache.Capacity();
+        }
+
+        void Clear()
+        {
+            this->cache.Clear();
+        }
+
+        // 文件不存在时返回-1
+        static int64_t FileMtime(const std::string& path)
+        {
+            struct stat st;
+            return stat(path.c_str(), &st) == 0 ? (int64_t)st.st_mtime : -1;
+        }
+
+    private:
+        // 缓存的底层，raster 不为空时为预乘的RGBA8像素，否则为 image
+        struct Layer {
+            Magick::Image image;
+            Raster raster;
+            Dependencies deps;
+        };
+
+        // 查找并逐个校验素材的mtime，像素种类不符时视为未命中
+        bool Lookup(const std::string& key, Layer& layer, bool raster)
+        {
+            bool hit = this->cache.Get(key, layer) && layer.raster.Empty() != raster;
+            for (size_t i = 0; hit && i < layer.deps.size(); ++i)
+                hit = FileMtime(layer.deps[i].first) == layer.deps[i].second;
+            ++(hit ? Metrics::Global().layer_hits : Metrics::Global().layer_misses);
+            return hit;
+        }
+
+        LruCache<std::string, Layer> cache;
+    };
+
+    /*
+     * 编码结果（整张卡片）的缓存，键为渲染输入的哈希
+     * TTL 内相同的请求直接返回缓存的数据；同一个键正在渲染时，其他请求等待这一次的结果
+     * 而不重复渲染（single-flight），渲染失败时等待的请求得到同样的异常
+     * ttl 为0时（默认）不缓存结果，只合并同时进行的相同请求
+     */
+    class OutputCache {
+    public:
+        explicit OutputCache(size_t capacity = 32 << 20, int64_t ttl_ms = 0)
+            : cache(capacity), ttl_ms(ttl_ms)
+        {
+        }
+
+        // 取得键对应的数据，没有缓存且没有正在进行的渲染时调用 render 生成
+        Magick::Blob Get(uint64_t key, const std::function<Magick::Blob()>& render)
+        {
+            std::promise<Magick::Blob> promise;
+            std::shared_future<Magick::Blob> future;
+            int64_t ttl;
+            {
+                std::lock_guard<std::mutex> lock(this->mutex);
+                Entry entry;
+                if (this->cache.Get(key, entry) && Clock::now() < entry.expires)
+                    return entry.blob;
+                auto it = this->inflight.find(key);
+                if (it != this->inflight.end())
+                    future = it->second;
+                else
+                    this->inflight[key] = promise.get_future().share();
+                ttl = this->ttl_ms;
+            }
+            if (future.valid())
+                return future.get();
+
+            try
+            {
+                Magick::Blob blob = render();
+                {
+                    std::lock_guard<std::mutex> lock(this->mutex);
+                    if (ttl > 0)
+                        this->cache.Put(
+                            key,
+                            Entry{blob, Clock::now() + std::chrono::milliseconds(ttl)},
+                            blob.length());
+                    this->inflight.erase(key);
+                }
+                promise.set_value(blob);
+                return blob;
+            }
+            catch (...)
+            {
+                {
+                    std::lock_guard<std::mutex> lock(this->mutex);
+                    this->inflight.erase(key);
+                }
+                promise.set_exception(std::current_exception());
+                throw;
+            }
+        }
+
+        // 设置TTL（毫秒），为0时关闭缓存并丢弃已缓存的结果
+        void SetTtl(int64_t ms)
+        {
+            std::lock_guard<std::mutex> lock(this->mutex);
+            this->ttl_ms = ms;
+            if (ms <= 0)
+                this->cache.Clear();
+        }
+
+        int64_t Ttl() const
+        {
+            std::lock_guard<std::mutex> lock(this->mutex);
+            return this->ttl_ms;
+        }
+
+        void SetCapacity(size_t bytes)
+        {
+            this->cache.SetCapacity(bytes);
+        }
+
+        size_t Capacity() const
+        {
+            return this->cache.Capacity();
+        }
+
+        void Clear()
+        {
+            this->cache.Clear();
+        }
+
+    private:
+        typedef std::chrono::steady_clock Clock;
+
+        struct Entry {
+            Magick::Blob blob;
+            Clock::time_point expires;
+        };
+
+        LruCache<uint64_t, Entry> cache;
+        std::unordered_map<uint64_t, std::shared_future<Magick::Blob>> inflight;
+        int64_t ttl_ms;
+        mutable std::mutex mutex;
+    };
+
+    /*
+     * 字形缓存：常驻已加载的字体，并缓存按 (字体, 字号, 码位, 亚像素相位) 栅格化的字形位图
+     * 和按 (字体, 字号, 前一个码位, 码位) 的字距调整
+     * 只有加载字体、切换字号、栅格化和查询字距（即缓存未命中时）才在 face_mutex 下进行，
+     * 缓存命中时不使用 FT_Face，缓存的位图只读，可被多个线程同时使用
+     */
+    class GlyphCache {
+    public:
+        struct Glyph {
+            int left, top;   // 位图相对于笔位置和基线的偏移
+            int width, rows; // 位图大小
+            FT_Pos advance;  // 笔位置的前进量 (26.6)
+            FT_UInt index;   // 字体中的字形序号
+            std::vector<unsigned char> coverage;
+        };
+
+        // 排好版的字形：位图左上角在画布上的坐标
+        struct PlacedGlyph {
+            int x, y;
+            std::shared_ptr<const Glyph> glyph;
+        };
+
+        explicit GlyphCache(size_t capacity = 16 << 20)
+            : cache(capacity), kernings(1 << 20), library(nullptr)
+        {
+        }
+
+        ~GlyphCache()
+        {
+            for (FT_Face face : this->faces)
+            {
+                if (face)
+                    FT_Done_Face(face);
+            }
+            if (this->library)
+                FT_Done_FreeType(this->library);
+        }
+
+        GlyphCache(const GlyphCache&) = delete;
+        GlyphCache& operator=(const GlyphCache&) = delete;
+
+        /*
+         * 排版一行文字
+         * 参数列表:
+         *** font (const std::string&) 字体文件路径
+         *** pointsize (double) 字号（与 Magick 一样按 72DPI，即等于像素大小）
+         *** x (double) 基线起点的x坐标
+         *** y (double) 基线的y坐标
+         *** codepoints (const std::vector<uint32_t>&) 文字的码位
+         *** out (std::vector<PlacedGlyph>&) 排版结果
+         * 字体无法加载或字形无法栅格化时返回false
+         */
+        bool Layout(const std::string& font, double pointsize, double x, double y,
+                    const std::vector<uint32_t>& codepoints,
+                    std::vector<PlacedGlyph>& out)
+        {
+            int id;
+            FT_Face face;
+            {
+                std::lock_guard<std::mutex> lock(this->face_mutex);
+                id = this->FaceId(font);
+                if (id < 0)
+                    return false;
+                face = this->faces[id];
+            }
+            const bool kerning = FT_HAS_KERNING(face);
+            const uint32_t size = (uint32_t)(pointsize * 64 + 0.5);
+
+            FT_Pos pen = (FT_Pos)floor(x * 64 + 0.5);
+            const int baseline = (int)floor(y + 0.5);
+            out.clear();
+            for (size_t i = 0; i < codepoints.size(); ++i)
+            {
+                const uint32_t codepoint = codepoints[i];
+                if (i && kerning)
+                    pen += this->Kerning(id, face, size, codepoints[i - 1], codepoint);
+                const uint32_t phase = (uint32_t)((pen & 63) >> 4);
+                GlyphKey key{(uint32_t)id, size, codepoint, phase};
+                std::shared_ptr<const Glyph> glyph;
+                if (this->cache.Get(key, glyph))
+                    ++Metrics::Global().glyph_hits;
+                else
+                {
+                    ++Metrics::Global().glyph_misses;
+                    {
+                        std::lock_guard<std::mutex> lock(this->face_mutex);
+                        if (this->SetSize(id, size))
+                            glyph = Rasterize(face, FT_Get_Char_Index(face, codepoint), phase);
+                    }
+                    if (!glyph)
+                        return false;
+                    this->cache.Put(key, glyph, sizeof(Glyph) + glyph->coverage.size());
+                }
+                out.push_back(PlacedGlyph{
+                    (int)(pen >> 6) + glyph->left, baseline - glyph->top, glyph});
+                pen += glyph->advance;
+            }
+            return true;
+        }
+
+        // 加载字体并常驻，成功时返回true
+        bool LoadFace(const std::string& font)
+        {
+            std::lock_guard<std::mutex> lock(this->face_mutex);
+            return this->FaceId(font) >= 0;
+        }
+
+        void SetCapacity(size_t bytes)
+        {
+            this->cache.SetCapacity(bytes);
+        }
+
+        size_t Capacity() const
+        {
+            return this->cache.Capacity();
+        }
+
+        // UTF-8解码，非法的字节按U+FFFD处理
+        static void DecodeUtf8(const std::string& str, std::vector<uint32_t>& out)
+        {
+            out.clear();
+            for (size_t i = 0; i < str.size();)
+            {
+                const unsigned char c = str[i];
+                int length = c < 0x80 ? 1 : (c >> 5) == 6 ? 2 : (c >> 4) == 14 ? 3
+                                          : (c >> 3) == 30 ? 4 : 0;
+                if (!length || i + length > str.size())
+                {
+                    out.push_back(0xFFFD);
+                    ++i;
+                    continue;
+                }
+                uint32_t codepoint = length == 1 ? c : c & (0x7F >> length);
+                for (int k = 1; k < length; ++k)
+                    codepoint = codepoint << 6 | (str[i + k] & 0x3F);
+                out.push_back(codepoint);
+                i += length;
+            }
+        }
+
+        static GlyphCache& Global()
+        {
+            static GlyphCache instance;
+            return instance;
+        }
+
+    private:
+        struct GlyphKey {
+            uint32_t face, size, codepoint, phase;
+
+            bool operator==(const GlyphKey& rhs) const
+            {
+                return face == rhs.face && size == rhs.size
+                       && codepoint == rhs.codepoint && phase == rhs.phase;
+            }
+        };
+
+        struct GlyphKeyHash {
+            size_t operator()(const GlyphKey& key) const
+            {
+                return std::hash<uint64_t>()(
+                    (uint64_t)key.codepoint << 32 ^ (uint64_t)key.size << 12
+                    ^ key.face << 2 ^ key.phase);
+            }
+        };
+
+        // 字距调整的键：(字体编号, 字号, 前一个码位, 码位)
+        struct KerningKey {
+            uint32_t face, size, left, right;
+
+            bool operator==(const KerningKey& rhs) const
+            {
+                return face == rhs.face && size == rhs.size && left == rhs.left
+                       && right == rhs.right;
+            }
+        };
 
-#include <fstream>
-#include <random>
-#include <regex>
-#include <sstream>
-#include <string>
-#include <vector>
+        struct KerningKeyHash {
+            size_t operator()(const KerningKey& key) const
+            {
+                return std::hash<uint64_t>()(((uint64_t)key.left << 32 | key.right) * 31
+                                             + ((uint64_t)key.size << 8 ^ key.face));
+            }
+        };
 
-#ifndef WIN32
-#define MAGICKCORE_QUANTUM_DEPTH 16
-#ifndef MAGICKCORE_HDRI_ENABLE
-#define MAGICKCORE_HDRI_ENABLE TRUE
-#endif
-#endif
-#include <Magick++.h>
-#include <random>
-#include <string>
+        /*
+         * 两个码位之间的字距调整 (26.6)，结果缓存，未命中时在 face_mutex 下查询
+         * 前一个字形在字体中不存在时不调整
+         */
+        FT_Pos Kerning(int id, FT_Face face, uint32_t size, uint32_t left, uint32_t right)
+        {
+            const KerningKey key{(uint32_t)id, size, left, right};
+            FT_Pos value = 0;
+            if (this->kernings.Get(key, value))
+                return value;
+            {
+                std::lock_guard<std::mutex> lock(this->face_mutex);
+                const FT_UInt previous = FT_Get_Char_Index(face, left);
+                FT_Vector vector;
+                if (previous && this->SetSize(id, size)
+                    && !FT_Get_Kerning(face,
+                                       previous,
+                                       FT_Get_Char_Index(face, right),
+                                       FT_KERNING_DEFAULT,
+                                       &vector))
+                    value = vector.x;
+            }
+            this->kernings.Put(key, value, sizeof(key) + sizeof(value));
+            return value;
+        }
+
+        // 取得字体的编号，首次使用时加载；加载失败返回-1（失败也会被记住）
+        int FaceId(const std::string& font)
+        {
+            auto it = this->face_ids.find(font);
+            if (it != this->face_ids.end())
+                return this->faces[it->second] ? it->second : -1;
+            FT_Face face = nullptr;
+            if (!this->library && FT_Init_FreeType(&this->library))
+                this->library = nullptr;
+            if (this->library && FT_New_Face(this->library, font.c_str(), 0, &face))
+                face = nullptr;
+            const int id = (int)this->faces.size();
+            this->faces.push_back(face);
+            this->face_sizes.push_back(0);
+            this->face_ids[font] = id;
+            return face ? id : -1;
+        }
+
+        bool SetSize(int id, uint32_t size)
+        {
+            if (this->face_sizes[id] == size)
+                return true;
+            if (FT_Set_Char_Size(this->faces[id], 0, size, 72, 72))
+                return false;
+            this->face_sizes[id] = size;
+            return true;
+        }
+
+        // 按 Magick 的方式（轻度微调、抗锯齿）栅格化，phase为四分之一像素的水平偏移
+        static std::shared_ptr<const Glyph> Rasterize(FT_Face face, FT_UInt index,
+                                                      uint32_t phase)
+        {
+            if (FT_Load_Glyph(
+                    face, index, FT_LOAD_DEFAULT | FT_LOAD_NO_BITMAP | FT_LOAD_TARGET_LIGHT))
+                return nullptr;
+            FT_GlyphSlot slot = face->glyph;
+            if (slot->format == FT_GLYPH_FORMAT_OUTLINE)
+                FT_Outline_Translate(&slot->outline, phase * 16, 0);
+            if (FT_Render_Glyph(slot, FT_RENDER_MODE_LIGHT)
+                || slot->bitmap.pixel_mode != FT_PIXEL_MODE_GRAY)
+                return nullptr;
+
+            std::shared_ptr<Glyph> glyph = std::make_shared<Glyph>();
+            glyph->left = slot->bitmap_left;
+            glyph->top = slot->bitmap_top;
+            glyph->width = (int)slot->bitmap.width;
+            glyph->rows = (int)slot->bitmap.rows;
+            glyph->advance = slot->advance.x;
+            glyph->index = index;
+            glyph->coverage.resize((size_t)glyph->width * glyph->rows);
+            for (int row = 0; row < glyph->rows; ++row)
+            {
+                const unsigned char* src = slot->bitmap.pitch >= 0
+                    ? slot->bitmap.buffer + row * slot->bitmap.pitch
+                    : slot->bitmap.buffer + (glyph->rows - 1 - row) * -slot->bitmap.pitch;
+                memcpy(&glyph->coverage[(size_t)row * glyph->width], src, glyph->width);
+            }
+            return glyph;
+        }
+
+        LruCache<GlyphKey, std::shared_ptr<const Glyph>, GlyphKeyHash> cache;
+        LruCache<KerningKey, FT_Pos, KerningKeyHash> kernings;
+        std::mutex face_mutex;
+        FT_Library library;
+        std::unordered_map<std::string, int> face_ids;
+        std::vector<FT_Face> faces;
+        std::vector<uint32_t> face_sizes;
+    };
+
+    /*
+     * 64位的感知哈希（DCT pHash）
+     * 图片缩为32x32灰度，取二维DCT左上角8x8的低频系数，大于中位数的位置为1
+     * 相似的图片汉明距离小，一般 10 以下认为是同一张图
+     */
+    struct PHash {
+        uint64_t bits;
+
+        static PHash Compute(const Magick::Image& source)
+        {
+            const int N = 32;
+            Magick::Image img(source);
+            Magick::Geometry geometry(N, N);
+            geometry.aspect(true);
+            img.resize(geometry);
+            double pixels[N * N];
+            img.write(0, 0, N, N, "I", MagickCore::DoublePixel, pixels);
+
+            // 可分离的二维DCT-II，只需要前8个频率
+            static double cosine[8][N];
+            static std::once_flag once;
+            std::call_once(once, [] {
+                for (int u = 0; u < 8; ++u)
+                    for (int x = 0; x < N; ++x)
+                        cosine[u][x] = cos((2 * x + 1) * u * acos(-1.0) / (2 * N));
+            });
+            double rows[N][8];
+            for (int y = 0; y < N; ++y)
+                for (int u = 0; u < 8; ++u)
+                {
+                    double sum = 0;
+                    for (int x = 0; x < N; ++x)
+                        sum += pixels[y * N + x] * cosine[u][x];
+                    rows[y][u] = sum;
+                }
+            double coefficients[64];
+            for (int v = 0; v < 8; ++v)
+                for (int u = 0; u < 8; ++u)
+                {
+                    double sum = 0;
+                    for (int y = 0; y < N; ++y)
+                        sum += rows[y][u] * cosine[v][y];
+                    coefficients[v * 8 + u] = sum;
+                }
+
+            // 中位数不计直流分量
+            double sorted[63];
+            std::copy(coefficients + 1, coefficients + 64, sorted);
+            std::nth_element(sorted, sorted + 31, sorted + 63);
+            const double median = sorted[31];
+            PHash hash{0};
+            for (int i = 0; i < 64; ++i)
+            {
+                if (coefficients[i] > median)
+                    hash.bits |= 1ULL << i;
+            }
+            return hash;
+        }
+
+        static int Distance(PHash a, PHash b)
+        {
+            return (int)popcount64(a.bits ^ b.bits);
+        }
+
+        // 16位十六进制字符串
+        std::string ToString() const
+        {
+            char buf[17];
+            sprintfS(buf, 17, "%016llx", (unsigned long long)this->bits);
+            return buf;
+        }
+
+        static bool FromString(const std::string& str, PHash& hash)
+        {
+            if (str.size() != 16)
+                return false;
+            char* end;
+            unsigned long long bits = strtoull(str.c_str(), &end, 16);
+            if (*end)
+                return false;
+            hash.bits = bits;
+            return true;
+        }
+    };
+
+    /*
+     * 感知哈希的相似度索引（BK树，按汉明距离组织）
+     * 查询"距离不超过d的所有图片"时，借助三角不等式只访问一小部分节点
+     */
+    class PHashIndex {
+    public:
+        void Insert(PHash hash, uint64_t id)
+        {
+            std::lock_guard<std::mutex> lock(this->mutex);
+            Node node{hash.bits, id, {}};
+            if (this->nodes.empty())
+            {
+                this->nodes.push_back(std::move(node));
+                return;
+            }
+            uint32_t current = 0;
+            for (;;)
+            {
+                const int distance =
+                    (int)popcount64(this->nodes[current].hash ^ hash.bits);
+                auto& children = this->nodes[current].children;
+                auto it = std::lower_bound(children.begin(),
+                                           children.end(),
+                                           std::make_pair((uint8_t)distance, (uint32_t)0));
+                if (it != children.end() && it->first == distance)
+                {
+                    current = it->second;
+                    continue;
+                }
+                children.insert(it, std::make_pair((uint8_t)distance, (uint32_t)this->nodes.size()));
+                this->nodes.push_back(std::move(node));
+                return;
+            }
+        }
+
+        /*
+         * 查询与 hash 距离不超过 max_distance 的所有项目
+         * 结果为 (id, 距离)，不保证顺序
+         */
+        void Query(PHash hash, int max_distance,
+                   std::vector<std::pair<uint64_t, int>>& out) const
+        {
+            std::lock_guard<std::mutex> lock(this->mutex);
+            if (this->nodes.empty())
+                return;
+            std::vector<uint32_t> stack(1, 0);
+            while (!stack.empty())
+            {
+                const Node& node = this->nodes[stack.back()];
+                stack.pop_back();
+                const int distance = (int)popcount64(node.hash ^ hash.bits);
+                if (distance <= max_distance)
+                    out.push_back(std::make_pair(node.id, distance));
+                for (const auto& child : node.children)
+                {
+                    if (child.first >= distance - max_distance
+                        && child.first <= distance + max_distance)
+                        stack.push_back(child.second);
+                }
+            }
+        }
+
+        size_t Size() const
+        {
+            std::lock_guard<std::mutex> lock(this->mutex);
+            return this->nodes.size();
+        }
+
+    private:
+        struct Node {
+            uint64_t hash;
+            uint64_t id;
+            // (到父节点的距离, 子节点下标)，按距离排序
+            std::vector<std::pair<uint8_t, uint32_t>> children;
+        };
+
+        std::vector<Node> nodes;
+        mutable std::mutex mutex;
+    };
+
+    /*
+     * 简单的固定大小线程池
+     * Submit提交任务，Wait等待所有已提交的任务完成，析构时等待并回收线程
+     */
+    class ThreadPool {
+    public:
+        explicit ThreadPool(size_t threads) : pending(0), stopping(false)
+        {
+            if (threads == 0)
+                threads = DefaultThreads();
+            for (size_t i = 0; i < threads; ++i)
+                this->workers.emplace_back([this] { this->Run(); });
+        }
+
+        ~ThreadPool()
+        {
+            {
+                std::lock_guard<std::mutex> lock(this->mutex);
+                this->stopping = true;
+            }
+            this->wake.notify_all();
+            for (auto& worker : this->workers)
+                worker.join();
+        }
+
+        ThreadPool(const ThreadPool&) = delete;
+        ThreadPool& operator=(const ThreadPool&) = delete;
+
+        void Submit(std::function<void()> task)
+        {
+            {
+                std::lock_guard<std::mutex> lock(this->mutex);
+                this->tasks.push_back(std::move(task));
+                ++this->pending;
+            }
+            this->wake.notify_one();
+        }
+
+        void Wait()
+        {
+            std::unique_lock<std::mutex> lock(this->mutex);
+            this->idle.wait(lock, [this] { return this->pending == 0; });
+        }
+
+        size_t Size() const
+        {
+            return this->workers.size();
+        }
+
+        static size_t DefaultThreads()
+        {
+            size_t n = std::thread::hardware_concurrency();
+            return n ? n : 1;
+        }
+
+    private:
+        void Run()
+        {
+            for (;;)
+            {
+                std::function<void()> task;
+                {
+                    std::unique_lock<std::mutex> lock(this->mutex);
+                    this->wake.wait(
+                        lock, [this] { return this->stopping || !this->tasks.empty(); });
+                    if (this->tasks.empty())
+                        return;
+                    task = std::move(this->tasks.front());
+                    this->tasks.pop_front();
+                }
+                task();
+                std::lock_guard<std::mutex> lock(this->mutex);
+                if (--this->pending == 0)
+                    this->idle.notify_all();
+            }
+        }
+
+        std::vector<std::thread> workers;
+        std::deque<std::function<void()>> tasks;
+        size_t pending;
+        bool stopping;
+        std::mutex mutex;
+        std::condition_variable wake, idle;
+    };
+
+    /*
+     * 有界的任务队列（异步渲染使用）
+     * 排队的任务达到容量时 TrySubmit 立即返回false，由调用方稍后重试，不会阻塞调用线程
+     * 工作线程在第一次提交时才创建；析构时执行完已排队的任务再回收线程
+     */
+    class WorkQueue {
+    public:
+        explicit WorkQueue(size_t threads = 0, size_t capacity = 64)
+            : target(threads ? threads : ThreadPool::DefaultThreads()), capacity(capacity),
+              alive(0), stopping(false)
+        {
+        }
+
+        ~WorkQueue()
+        {
+            {
+                std::lock_guard<std::mutex> lock(this->mutex);
+                this->stopping = true;
+            }
+            this->wake.notify_all();
+            for (auto& worker : this->workers)
+                worker.join();
+        }
+
+        WorkQueue(const WorkQueue&) = delete;
+        WorkQueue& operator=(const WorkQueue&) = delete;
+
+        bool TrySubmit(std::function<void()> task)
+        {
+            {
+                std::lock_guard<std::mutex> lock(this->mutex);
+                if (this->tasks.size() >= this->capacity)
+                    return false;
+                this->tasks.push_back(std::move(task));
+                for (; this->alive < this->target; ++this->alive)
+                    this->workers.emplace_back([this] { this->Run(); });
+            }
+            this->wake.notify_one();
+            return true;
+        }
+
+        /*
+         * 修改线程数和容量，threads为0时使用CPU核数
+         * 减少线程时多出的线程在执行完手上的任务后退出
+         */
+        void Configure(size_t threads, size_t capacity)
+        {
+            {
+                std::lock_guard<std::mutex> lock(this->mutex);
+                this->target = threads ? threads : ThreadPool::DefaultThreads();
+                this->capacity = capacity;
+                for (; !this->tasks.empty() && this->alive < this->target; ++this->alive)
+                    this->workers.emplace_back([this] { this->Run(); });
+            }
+            this->wake.notify_all();
+        }
+
+        size_t Threads() const
+        {
+            std::lock_guard<std::mutex> lock(this->mutex);
+            return this->target;
+        }
+
+        size_t Capacity() const
+        {
+            std::lock_guard<std::mutex> lock(this->mutex);
+            return this->capacity;
+        }
+
+        // 排队中（尚未开始执行）的任务数
+        size_t Pending() const
+        {
+            std::lock_guard<std::mutex> lock(this->mutex);
+            return this->tasks.size();
+        }
+
+    private:
+        void Run()
+        {
+            for (;;)
+            {
+                std::function<void()> task;
+                {
+                    std::unique_lock<std::mutex> lock(this->mutex);
+                    this->wake.wait(lock, [this] {
+                        return this->stopping || !this->tasks.empty()
+                               || this->alive > this->target;
+                    });
+                    if (this->tasks.empty() || (this->alive > this->target && !this->stopping))
+                    {
+                        --this->alive;
+                        return;
+                    }
+                    task = std::move(this->tasks.front());
+                    this->tasks.pop_front();
+                }
+                task();
+            }
+        }
+
+        std::vector<std::thread> workers;
+        std::deque<std::function<void()>> tasks;
+        size_t target, capacity, alive;
+        bool stopping;
+        mutable std::mutex mutex;
+        std::condition_variable wake;
+    };
+
+    /*
+     * Magick 内部（OpenMP）并行与外层同时渲染的卡片之间的线程预算，进程内所有上下文共用
+     * Magick 的资源限制是全局的，按深度（正在渲染和排队中的卡片数）调整，避免每张卡片都开满线程
+     *** Auto 深度为1时一张卡片使用所有核，深度越大每张卡片的线程越少，达到核数时每张一个线程
+     *** Wide 总是一张卡片使用所有核
+     *** Narrow 总是每张卡片一个线程，由外层的并行用满所有核
+     *** Off 不修改 Magick 的限制
+     * memory 不为0时设为 Magick 像素缓存的内存上限，并按深度平分为单张图片的 area 上限
+     * （不低于 MinArea），同时渲染的卡片不会一起挤占内存而落到磁盘
+     */
+    class ThreadBudget {
+    public:
+        enum Policy { Auto = 0, Wide, Narrow, Off };
+
+        static const uint64_t MinArea = 1080 * 1920;
+
+        // 一次渲染（录制、执行录制的命令和编码），构造时计入深度，析构时移出
+        class Scope {
+        public:
+            Scope()
+            {
+                ThreadBudget::Global().Add(1, 0);
+            }
+
+            ~Scope()
+            {
+                ThreadBudget::Global().Add(-1, 0);
+            }
+
+            Scope(const Scope&) = delete;
+            Scope& operator=(const Scope&) = delete;
+        };
+
+        struct State {
+            Policy policy;
+            size_t cores, active, queued;
+            uint64_t memory;
+        };
+
+        // cores 为0时使用CPU核数，memory 为0时不管理内存和 area
+        void Configure(Policy policy, size_t cores, uint64_t memory)
+        {
+            std::lock_guard<std::mutex> lock(this->mutex);
+            this->state.policy = policy;
+            this->state.cores = cores ? cores : ThreadPool::DefaultThreads();
+            this->state.memory = memory;
+            this->threads = this->area = 0;
+            if (policy != Off && memory)
+                Magick::ResourceLimits::memory(memory);
+            this->Apply();
+        }
+
+        // 正在渲染的卡片数加 active，排队中的任务数加 queued
+        void Add(int active, int queued)
+        {
+            std::lock_guard<std::mutex> lock(this->mutex);
+            this->state.active += active;
+            this->state.queued += queued;
+            this->Apply();
+        }
+
+        State Get() const
+        {
+            std::lock_guard<std::mutex> lock(this->mutex);
+            return this->state;
+        }
+
+        static const char* PolicyName(Policy policy)
+        {
+            static const char* names[] = {"auto", "wide", "narrow", "off"};
+            return names[policy];
+        }
+
+        static bool ParsePolicy(const std::string& name, Policy& policy)
+        {
+            for (int i = Auto; i <= Off; ++i)
+            {
+                if (name == PolicyName((Policy)i))
+                {
+                    policy = (Policy)i;
+                    return true;
+                }
+            }
+            return false;
+        }
+
+        static ThreadBudget& Global()
+        {
+            static ThreadBudget instance;
+            return instance;
+        }
+
+    private:
+        ThreadBudget() : threads(0), area(0)
+        {
+            this->state.policy = Auto;
+            this->state.cores = ThreadPool::DefaultThreads();
+            this->state.active = this->state.queued = 0;
+            this->state.memory = 0;
+        }
+
+        // 按当前深度设置 Magick 的限制，与上一次相同时不调用 Magick
+        void Apply()
+        {
+            if (this->state.policy == Off)
+                return;
+            const size_t depth = std::max<size_t>(1, this->state.active + this->state.queued);
+            const size_t threads = this->state.policy == Wide     ? this->state.cores
+                                   : this->state.policy == Narrow ? 1
+                                       : std::max<size_t>(1, this->state.cores / depth);
+            if (threads != this->threads)
+            {
+                Magick::ResourceLimits::thread(threads);
+                this->threads = threads;
+            }
+            if (!this->state.memory)
+                return;
+            const uint64_t area = std::max<uint64_t>(
+                uint64_t(MinArea), this->state.memory / (4 * QuantumTraits::Bytes()) / depth);
+            if (area != this->area)
+            {
+                Magick::ResourceLimits::area(area);
+                this->area = area;
+            }
+        }
+
+        State state;
+        size_t threads;
+        uint64_t area;
+        mutable std::mutex mutex;
+    };
+
+    /*
+     * 输出编码参数
+     *** profile 编码档位
+     ***** Fast 低zlib压缩等级、固定sub过滤器（JPEG/WebP为快速编码），延迟最低
+     ***** Balanced 中等压缩等级、自适应过滤器
+     ***** Archival 最高压缩等级，体积最小
+     *** quality JPEG/WebP的质量 (0~100)，小于0时使用档位的默认值，PNG忽略此项
+     */
+    struct EncodeOptions {
+        enum Profile { Fast = 0, Balanced, Archival };
+
+        Profile profile = Archival;
+        int quality = -1;
+
+        static const char* ProfileName(Profile profile)
+        {
+            static const char* names[] = {"fast", "balanced", "archival"};
+            return names[profile];
+        }
+
+        static bool ParseProfile(const std::string& name, Profile& profile)
+        {
+            for (int i = Fast; i <= Archival; ++i)
+            {
+                if (name == ProfileName((Profile)i))
+                {
+                    profile = (Profile)i;
+                    return true;
+                }
+            }
+            return false;
+        }
+    };
 
-namespace Sayobot
-{
     struct TextStyle {
         TextStyle(
             const std::string& _color = "black", const double _pointsize = 12.0f,
@@ -54,51 +3126,223 @@ namespace Sayobot
         {
         }
 
+        explicit Image(const Magick::Image& image) : image(image)
+        {
+        }
+
+        // 以预乘的RGBA8像素为画布，像素与 raster 共享，修改时才会复制
+        explicit Image(const Raster& raster) : raster(raster), rasterized(true)
+        {
+            this->canvas.Set(raster.Bytes());
+        }
+
+        const Magick::Image& GetMagickImage()
+        {
+            this->Flush();
+            this->UseMagick();
+            return this->image;
+        }
+
+        // 取得预乘的RGBA8像素，画布为 Magick::Image 时转换过来
+        const Raster& GetRaster()
+        {
+            this->Flush();
+            if (!this->rasterized)
+            {
+                this->raster = Raster::FromMagick(this->image);
+                this->image = Magick::Image();
+                this->rasterized = true;
+                this->canvas.Set(this->raster.Bytes());
+            }
+            return this->raster;
+        }
+
+        // 设置 DrawPic(path, ...) 使用的素材缓存
+        void SetAssetCache(AssetCache* cache)
+        {
+            this->assets = cache;
+        }
+
+        // 设置 Drawtext 使用的字形缓存，为NULL时总是由 Magick 绘制文字
+        void SetGlyphCache(GlyphCache* cache)
+        {
+            this->glyphs = cache;
+        }
+
+        /*
+         * 设置布局的缩放比例，同一套布局坐标可以直接画成不同的分辨率
+         * 之后 Create、DrawPic、Sprite、DrawSprite 和 Drawtext 的坐标、尺寸和字号都乘以它：
+         * 贴图按缩放后的尺寸取得（不指定尺寸的贴图按原尺寸缩放），文字按缩放后的字号栅格化
+         * 裁剪、旋转等直接操作像素的函数不受影响
+         */
+        void SetScale(double scale)
+        {
+            this->scale = scale > 0 ? scale : 1.0;
+        }
+
+        double Scale() const
+        {
+            return this->scale;
+        }
+
+        /*
+         * 进入录制模式：之后的 Drawtext 和 DrawPic 只记录为绘制命令，
+         * 在 Flush（保存、缩放、裁剪等操作前会自动调用）时合并执行
+         * 图片的读取和文字的排版仍然立即进行，读取失败照常抛出异常
+         */
+        void BeginRecord()
+        {
+            this->recording = true;
+        }
+
+        /*
+         * 执行所有录制的绘制命令
+         *** 相邻的贴图：互不重叠时按区域（从上到下、从左到右）排序后依次合成
+         *** 相邻的缓存字形文字：一次取出画布的像素，全部混合后一次写回
+         *** 相邻的 Magick 文字：合并为一个 DrawableList，只调用一次 draw
+         */
+        void Flush()
+        {
+            if (this->commands.empty())
+                return;
+            std::vector<DrawCommand> pending;
+            pending.swap(this->commands);
+            for (size_t begin = 0; begin < pending.size();)
+            {
+                size_t end = begin + 1;
+                while (end < pending.size() && pending[end].kind == pending[begin].kind)
+                    ++end;
+                if (pending[begin].kind == DrawCommand::Composite)
+                {
+                    StageTimer timer(StageTimes::Composite);
+                    this->FlushComposites(pending, begin, end);
+                }
+                else if (pending[begin].kind == DrawCommand::Glyphs)
+                {
+                    StageTimer timer(StageTimes::Text);
+                    std::vector<const TextRun*> runs;
+                    for (size_t i = begin; i < end; ++i)
+                        runs.push_back(&pending[i].run);
+                    this->BlendText(runs);
+                }
+                else
+                {
+                    StageTimer timer(StageTimes::Text);
+                    this->UseMagick();
+                    Magick::DrawableList drawableList;
+                    for (size_t i = begin; i < end; ++i)
+                    {
+                        drawableList.push_back(Magick::DrawablePushGraphicContext());
+                        AppendText(drawableList,
+                                   pending[i].text,
+                                   pending[i].style,
+                                   pending[i].text_x,
+                                   pending[i].text_y);
+                        drawableList.push_back(Magick::DrawablePopGraphicContext());
+                    }
+                    this->image.draw(drawableList);
+                }
+                begin = end;
+            }
+        }
+
+        /*
+         * 创建全透明的画布
+         * 画布保存为预乘的RGBA8像素，贴图和缓存字形直接在上面合成，
+         * 遇到需要 Magick 的操作（Magick 文字、缩放、保存等）时才转换为 Magick::Image
+         */
         void Create(const size_t &width, const size_t &height)
         {
-            this->image.size(Magick::Geometry(width, height));
-            //this->image.read("xc:#FFFFFF");
+            this->Flush();
+            this->Touch();
+            this->raster = Raster(this->ScaledSize(width), this->ScaledSize(height));
+            this->image = Magick::Image();
+            this->rasterized = true;
+            this->canvas.Set(this->raster.Bytes());
         }
 
         void ReadFromFile(const std::string& path)
         {
+            this->commands.clear();
+            this->Touch();
+            this->UseMagick();
             this->image.read(path);
         }
 
         void ReadFromUrl(const std::string& url)
         {
+            this->commands.clear();
+            this->Touch();
+            this->UseMagick();
             this->image = Magick::Image(url);
         }
 
         void Crop(const Magick::Geometry& geometry)
         {
+            this->Flush();
+            this->Touch();
+            this->UseMagick();
             this->image.crop(geometry);
         }
 
         void Crop(const size_t width, const size_t height, const size_t x_offset,
                   const size_t y_offset)
         {
+            this->Flush();
+            this->Touch();
+            this->UseMagick();
             this->image.crop(Magick::Geometry(width, height, x_offset, y_offset));
         }
 
         void Rotate(const double degrees)
         {
+            this->Flush();
+            this->Touch();
+            this->UseMagick();
             this->image.rotate(degrees);
         }
 
+        /*
+         * 按 TextStyle 在图上绘制文字
+         * 左对齐、无重力的单行文字经由字形缓存直接贴到画布上，其余情况交给 Magick
+         */
         void Drawtext(const std::string& str, const TextStyle& textStyle,
                       double x_offset, double y_offset)
         {
-            Magick::DrawableList drawableList;
-            drawableList.push_back(Magick::DrawableFillColor(textStyle.color));
-            std::string ext =
-                textStyle.font_family.substr(textStyle.font_family.find_last_of('.'));
-            drawableList.push_back(Magick::DrawableFont(textStyle.font_family));
-            drawableList.push_back(Magick::DrawablePointSize(textStyle.pointsize));
-            drawableList.push_back(Magick::DrawableText(x_offset, y_offset, str));
-            drawableList.push_back(Magick::DrawableGravity(textStyle.gravity));
-            drawableList.push_back(Magick::DrawableTextAlignment(textStyle.align));
-            this->image.draw(drawableList);
+            MetricTimer metric(Metrics::Global().drawtext);
+            StageTimer timer(StageTimes::Text);
+            this->Touch();
+            x_offset *= this->scale;
+            y_offset *= this->scale;
+            TextStyle style = textStyle;
+            style.pointsize *= this->scale;
+            DrawCommand command;
+            if (this->LayoutText(str, style, x_offset, y_offset, command.run))
+            {
+                command.kind = DrawCommand::Glyphs;
+                if (!this->recording)
+                {
+                    this->BlendText({&command.run});
+                    return;
+                }
+            }
+            else if (!this->recording)
+            {
+                this->UseMagick();
+                Magick::DrawableList drawableList;
+                AppendText(drawableList, str, style, x_offset, y_offset);
+                this->image.draw(drawableList);
+                return;
+            }
+            else
+            {
+                command.kind = DrawCommand::Text;
+                command.text = str;
+                command.style = style;
+                command.text_x = x_offset;
+                command.text_y = y_offset;
+            }
+            this->commands.push_back(std::move(command));
         }
         /*
          在图上绘制文字
@@ -125,12 +3369,17 @@ namespace Sayobot
                 MagickCore::GravityType::UndefinedGravity,
             const MagickCore::AlignType align = MagickCore::AlignType::UndefinedAlign)
         {
+            this->Flush();
+            this->Touch();
+            this->UseMagick();
+            StageTimer timer(StageTimes::Text);
             Magick::DrawableList drawableList;
             drawableList.push_back(Magick::DrawableFillColor(Color));
             drawableList.push_back(Magick::DrawableTextAlignment(align));
             drawableList.push_back(Magick::DrawableFont(fontFamily));
-            drawableList.push_back(Magick::DrawablePointSize(size));
-            drawableList.push_back(Magick::DrawableText(x_offset, y_offset, str));
+            drawableList.push_back(Magick::DrawablePointSize(size * this->scale));
+            drawableList.push_back(
+                Magick::DrawableText(x_offset * this->scale, y_offset * this->scale, str));
             drawableList.push_back(Magick::DrawableGravity(gravity));
             this->image.draw(drawableList);
         }
@@ -147,10 +3396,23 @@ namespace Sayobot
         void DrawPic(Image& image, const size_t x_offset, const size_t y_offset,
                      size_t width = 0, size_t height = 0)
         {
+            MetricTimer metric(Metrics::Global().drawpic);
+            if (this->scale != 1.0 && !(width && height))
+            {
+                image.Flush();
+                width = image.rasterized ? image.raster.Width() : image.image.columns();
+                height = image.rasterized ? image.raster.Height() : image.image.rows();
+            }
             if (width && height)
-                image.resize(Magick::Geometry(width, height));
-            this->image.composite(
-                image.image, x_offset, y_offset, MagickCore::OverCompositeOp);
+                image.resize(
+                    Magick::Geometry(this->ScaledSize(width), this->ScaledSize(height)));
+            image.Flush();
+            if (image.rasterized)
+                this->Composite(
+                    Magick::Image(), image.raster, this->Scaled(x_offset), this->Scaled(y_offset));
+            else
+                this->Composite(
+                    image.image, Raster(), this->Scaled(x_offset), this->Scaled(y_offset));
         }
 
         /*
@@ -161,47 +3423,213 @@ namespace Sayobot
          *** y_offset (size_t) 相对于起始点 (0, 0) 的y坐标偏移量
          *** 可选 width 重新调整图片宽度
          *** 可选 height 重新调整图片高度
+         * 解码和缩放的结果经由 SetAssetCache 设置的缓存（默认为 AssetCache::Global()）缓存
          */
         void DrawPic(const std::string& path, size_t x_offset, size_t y_offset,
                      size_t width = 0, size_t height = 0)
         {
-            Magick::Image newImage;
-            newImage.read(path);
+            MetricTimer metric(Metrics::Global().drawpic);
+            this->ScaleGeometry(path, width, height);
+            if (this->rasterized)
+                this->Composite(Magick::Image(),
+                                this->assets->LoadRaster(path, width, height),
+                                this->Scaled(x_offset),
+                                this->Scaled(y_offset));
+            else
+                this->Composite(this->assets->Load(path, width, height),
+                                Raster(),
+                                this->Scaled(x_offset),
+                                this->Scaled(y_offset));
+        }
 
-            if (width && height)
-                newImage.resize(Magick::Geometry(width, height));
-            this->image.composite(
-                newImage, x_offset, y_offset, MagickCore::OverCompositeOp);
+        /*
+         * 取得缩放好的贴图，同一 (素材, 尺寸, 滤镜) 只解码和缩放一次，
+         * 结果保存在素材缓存中，同一张卡片和之后的卡片都可以重复使用
+         * 参数列表:
+         *** path (const std::string&) 图片路径
+         *** width, height (size_t) 缩放后的大小，都为0时不缩放
+         *** 可选 filter 缩放使用的滤镜，默认由 Magick 决定
+         * 文件不存在或无法解码时抛出Magick::Exception
+         */
+        Raster Sprite(const std::string& path, size_t width, size_t height,
+                      MagickCore::FilterType filter = MagickCore::UndefinedFilter)
+        {
+            this->ScaleGeometry(path, width, height);
+            return this->assets->LoadRaster(path, width, height, filter);
+        }
+
+        /*
+         * 布局尺寸按 scale 换算为像素尺寸，非0的尺寸至少为1
+         * Sprite/DrawPic 与预加载、素材包使用同一换算，缓存键才能对上
+         */
+        static size_t ScaleSize(size_t value, double scale)
+        {
+            return value ? std::max<size_t>(1, (size_t)(value * scale + 0.5)) : 0;
+        }
+
+        /*
+         * 贴图请求的尺寸按 scale 换算为像素尺寸
+         * 不指定尺寸时按素材的原尺寸缩放，原尺寸由 AssetCache::NativeSize 取得
+         */
+        static void ScaleGeometry(const AssetCache& assets, const std::string& path,
+                                  size_t& width, size_t& height, double scale)
+        {
+            if (scale == 1.0)
+                return;
+            if (!width || !height)
+                assets.NativeSize(path, width, height);
+            width = ScaleSize(width, scale);
+            height = ScaleSize(height, scale);
+        }
+
+        /*
+         * 贴上 Sprite 取得的贴图，不再查找缓存
+         * 参数列表:
+         *** sprite (const Raster&) 贴图
+         *** x_offset (ssize_t) 相对于起始点 (0, 0) 的x坐标偏移量
+         *** y_offset (ssize_t) 相对于起始点 (0, 0) 的y坐标偏移量
+         */
+        void DrawSprite(const Raster& sprite, ssize_t x_offset, ssize_t y_offset)
+        {
+            MetricTimer metric(Metrics::Global().drawpic);
+            this->Composite(
+                Magick::Image(), sprite, this->Scaled(x_offset), this->Scaled(y_offset));
         }
 
+        /*
+         * 从感知哈希中随机截取一段，感知哈希只在图片修改后才重新计算
+         * 只需要文件名时请使用 GetContentHash
+         */
         std::string GetRandomHash(int length = 16)
         {
-            std::default_random_engine random(time(NULL));
+            static thread_local std::default_random_engine random(std::random_device{}());
             std::uniform_int_distribution<int> dist(0, 128);
             int randint = dist(random);
-            return std::string(this->image.perceptualHash()).substr(randint, length);
+            return this->GetFullHash().substr(randint, length);
         }
 
+        // 完整的感知哈希，结果会被记住直到图片被修改
         std::string GetFullHash()
         {
-            return std::string(this->image.perceptualHash());
+            this->Flush();
+            if (this->phash.empty())
+            {
+                this->UseMagick();
+                this->phash = std::string(this->image.perceptualHash());
+            }
+            return this->phash;
+        }
+
+        /*
+         * 廉价的内容哈希（16位十六进制）：对像素做快速的非加密哈希，不计算感知哈希
+         * 结果会被记住直到图片被修改
+         */
+        std::string GetContentHash()
+        {
+            this->Flush();
+            if (this->content_hash.empty())
+            {
+                const size_t width = this->rasterized ? this->raster.Width()
+                                                      : this->image.columns();
+                const size_t height = this->rasterized ? this->raster.Height()
+                                                       : this->image.rows();
+                std::vector<unsigned char> pixels(width * height * 4);
+                if (!pixels.empty() && this->rasterized)
+                    this->raster.Export(&pixels[0]);
+                else if (!pixels.empty())
+                    this->image.write(
+                        0, 0, width, height, "RGBA", MagickCore::CharPixel, &pixels[0]);
+                Hasher hasher;
+                hasher.Add((uint64_t)width);
+                hasher.Add((uint64_t)height);
+                hasher.Update(pixels.data(), pixels.size());
+                this->content_hash = hasher.HexDigest();
+            }
+            return this->content_hash;
+        }
+
+        // 64位的感知哈希，用 PHash::Distance 比较；结果会被记住直到图片被修改
+        PHash GetBinaryHash()
+        {
+            this->Flush();
+            if (!this->has_binary_hash)
+            {
+                this->UseMagick();
+                this->binary_hash = PHash::Compute(this->image);
+                this->has_binary_hash = true;
+            }
+            return this->binary_hash;
         }
         /*
          * 保存图片
          */
         void Save(const std::string& path)
         {
+            MetricTimer metric(Metrics::Global().save);
+            this->Flush();
+            StageTimer timer(StageTimes::Encode);
+            this->UseMagick();
             this->image.quality(100);
             this->image.write(path);
         }
 
+        /*
+         * 按编码参数保存图片，格式由后缀名决定
+         */
+        void Save(const std::string& path, const EncodeOptions& options)
+        {
+            MetricTimer metric(Metrics::Global().save);
+            this->Flush();
+            StageTimer timer(StageTimes::Encode);
+            this->UseMagick();
+            this->ApplyEncodeOptions(FormatFromPath(path), options);
+            this->image.write(path);
+        }
+
+        // 由后缀名得到大写的格式名（JPG 为 JPEG），没有后缀名时返回空字符串
+        static std::string FormatFromPath(const std::string& path)
+        {
+            std::string format;
+            size_t dot = path.find_last_of('.');
+            if (dot != std::string::npos && path.find_first_of("/\\", dot) == std::string::npos)
+                format = path.substr(dot + 1);
+            for (auto& c : format)
+                c = toupper((unsigned char)c);
+            return format == "JPG" ? "JPEG" : format;
+        }
+
+        /*
+         * 将图片编码到内存
+         * 参数列表:
+         *** blob (Magick::Blob&) 输出的编码数据
+         *** format (const std::string&) 格式名（PNG、JPEG、WEBP 等）
+         *** 可选 options 编码参数，默认为 Archival
+         */
+        void Save(Magick::Blob& blob, const std::string& format,
+                  const EncodeOptions& options = EncodeOptions())
+        {
+            MetricTimer metric(Metrics::Global().save);
+            this->Flush();
+            StageTimer timer(StageTimes::Encode);
+            this->UseMagick();
+            this->image.magick(format);
+            this->ApplyEncodeOptions(format, options);
+            this->image.write(&blob);
+        }
+
         void resize(const Magick::Geometry& geometry)
         {
+            this->Flush();
+            this->Touch();
+            this->UseMagick();
             this->image.resize(geometry);
         }
 
         void resize(size_t width, size_t height)
         {
+            this->Flush();
+            this->Touch();
+            this->UseMagick();
             this->image.resize(Magick::Geometry(width, height));
         }
 
@@ -223,7 +3651,357 @@ namespace Sayobot
         }
 
     private:
+        // 已排版、等待混合的一行文字
+        struct TextRun {
+            std::vector<GlyphCache::PlacedGlyph> glyphs;
+            Magick::Color color;
+        };
+
+        // 录制模式下的绘制命令
+        struct DrawCommand {
+            enum Kind { Composite, Glyphs, Text } kind;
+            // Composite：sprite 不为空时贴 sprite，否则贴 picture
+            Magick::Image picture;
+            Raster sprite;
+            ssize_t x, y;
+
+            ssize_t Width() const
+            {
+                return sprite.Empty() ? picture.columns() : sprite.Width();
+            }
+
+            ssize_t Height() const
+            {
+                return sprite.Empty() ? picture.rows() : sprite.Height();
+            }
+            // Glyphs
+            TextRun run;
+            // Text：交给 Magick 绘制的文字
+            std::string text;
+            TextStyle style;
+            double text_x, text_y;
+        };
+
+        // 布局坐标换算为像素坐标
+        ssize_t Scaled(double value) const
+        {
+            return (ssize_t)std::floor(value * this->scale + 0.5);
+        }
+
+        // 布局尺寸换算为像素尺寸，非0的尺寸至少为1
+        size_t ScaledSize(size_t value) const
+        {
+            return ScaleSize(value, this->scale);
+        }
+
+        /*
+         * 贴图请求的尺寸换算为像素尺寸
+         * 不指定尺寸时按素材的原尺寸（只读取文件头）缩放
+         */
+        void ScaleGeometry(const std::string& path, size_t& width, size_t& height)
+        {
+            ScaleGeometry(*this->assets, path, width, height, this->scale);
+        }
+
+        // 图片内容即将改变，丢弃记住的哈希
+        void Touch()
+        {
+            this->phash.clear();
+            this->content_hash.clear();
+            this->has_binary_hash = false;
+        }
+
+        // 画布改为 Magick::Image（之后的操作都在 Magick 上进行）
+        void UseMagick()
+        {
+            if (!this->rasterized)
+                return;
+            this->image = this->raster.ToMagick();
+            this->raster = Raster();
+            this->rasterized = false;
+            this->canvas.Set(AssetCache::ImageBytes(this->image));
+        }
+
+        // 可以修改的像素，与缓存或其他 Image 共享时先复制一份
+        Raster& MutableRaster()
+        {
+            if (!this->raster.Unique())
+            {
+                this->raster = this->raster.Clone();
+                this->canvas.Set(this->raster.Bytes());
+            }
+            return this->raster;
+        }
+
+        void Composite(const Magick::Image& picture, const Raster& sprite,
+                       ssize_t x_offset, ssize_t y_offset)
+        {
+            this->Touch();
+            DrawCommand command;
+            command.kind = DrawCommand::Composite;
+            command.picture = picture;
+            command.sprite = sprite;
+            command.x = x_offset;
+            command.y = y_offset;
+            if (!this->recording)
+            {
+                StageTimer timer(StageTimes::Composite);
+                this->Blit(command);
+                return;
+            }
+            this->commands.push_back(std::move(command));
+        }
+
+        /*
+         * Over 合成一张贴图
+         * 画布和贴图都是RGBA8时由 Compositor 完成，否则转换贴图后交给 Magick
+         */
+        void Blit(const DrawCommand& command)
+        {
+            if (this->rasterized)
+                Compositor::Over(this->MutableRaster(),
+                                 command.sprite.Empty() ? Raster::FromMagick(command.picture)
+                                                        : command.sprite,
+                                 command.x,
+                                 command.y);
+            else
+                this->image.composite(
+                    command.sprite.Empty() ? command.picture : command.sprite.ToMagick(),
+                    command.x,
+                    command.y,
+                    MagickCore::OverCompositeOp);
+        }
+
+        // 合成 [begin, end) 内的贴图，互不重叠时先按区域排序
+        void FlushComposites(std::vector<DrawCommand>& pending, size_t begin, size_t end)
+        {
+            std::vector<DrawCommand*> order;
+            for (size_t i = begin; i < end; ++i)
+                order.push_back(&pending[i]);
+            bool overlapped = false;
+            for (size_t i = 0; i < order.size() && !overlapped; ++i)
+            {
+                for (size_t j = i + 1; j < order.size() && !overlapped; ++j)
+                {
+                    const DrawCommand& a = *order[i];
+                    const DrawCommand& b = *order[j];
+                    overlapped = a.x < b.x + b.Width() && b.x < a.x + a.Width()
+                                 && a.y < b.y + b.Height() && b.y < a.y + a.Height();
+                }
+            }
+            if (!overlapped)
+            {
+                std::stable_sort(
+                    order.begin(), order.end(), [](const DrawCommand* a, const DrawCommand* b) {
+                        return a->y != b->y ? a->y < b->y : a->x < b->x;
+                    });
+            }
+            for (const DrawCommand* command : order)
+                this->Blit(*command);
+        }
+
+        // 与原先相同的顺序生成 Magick 的文字绘制命令
+        static void AppendText(Magick::DrawableList& drawableList, const std::string& str,
+                               const TextStyle& textStyle, double x_offset,
+                               double y_offset)
+        {
+            drawableList.push_back(Magick::DrawableFillColor(textStyle.color));
+            drawableList.push_back(Magick::DrawableFont(textStyle.font_family));
+            drawableList.push_back(Magick::DrawablePointSize(textStyle.pointsize));
+            drawableList.push_back(Magick::DrawableText(x_offset, y_offset, str));
+            drawableList.push_back(Magick::DrawableGravity(textStyle.gravity));
+            drawableList.push_back(Magick::DrawableTextAlignment(textStyle.align));
+        }
+
+        // 使用字形缓存排版文字，不支持的样式或字体返回false
+        bool LayoutText(const std::string& str, const TextStyle& textStyle,
+                        double x_offset, double y_offset, TextRun& run)
+        {
+            if (!this->glyphs || str.find('\n') != std::string::npos)
+                return false;
+            if (textStyle.gravity != MagickCore::UndefinedGravity
+                && textStyle.gravity != MagickCore::NorthWestGravity)
+                return false;
+            if (textStyle.align != MagickCore::UndefinedAlign
+                && textStyle.align != MagickCore::LeftAlign)
+                return false;
+
+            std::vector<uint32_t> codepoints;
+            GlyphCache::DecodeUtf8(str, codepoints);
+            if (!this->glyphs->Layout(textStyle.font_family,
+                                      textStyle.pointsize,
+                                      x_offset,
+                                      y_offset,
+                                      codepoints,
+                                      run.glyphs))
+                return false;
+            run.color = Magick::Color(textStyle.color);
+            return true;
+        }
+
+        /*
+         * 将排好版的文字混合到画布上
+         * 只取出覆盖所有字形的整行区域（整行时像素缓存可直接访问，不需要复制）
+         */
+        void BlendText(const std::vector<const TextRun*>& runs)
+        {
+            if (this->rasterized)
+            {
+                this->BlendRasterText(runs);
+                return;
+            }
+            ssize_t y0 = this->image.rows(), y1 = 0;
+            for (const TextRun* run : runs)
+            {
+                for (const auto& g : run->glyphs)
+                {
+                    if (!g.glyph->width || !g.glyph->rows)
+                        continue;
+                    y0 = std::min<ssize_t>(y0, g.y);
+                    y1 = std::max<ssize_t>(y1, g.y + g.glyph->rows);
+                }
+            }
+            y0 = std::max<ssize_t>(y0, 0);
+            y1 = std::min<ssize_t>(y1, this->image.rows());
+            const ssize_t width = this->image.columns();
+            if (y0 >= y1 || !width)
+                return;
+
+            this->image.modifyImage();
+            Magick::Quantum* pixels = this->image.getPixels(0, y0, width, y1 - y0);
+            const MagickCore::Image* im = this->image.constImage();
+            const size_t channels = MagickCore::GetPixelChannels(im);
+            const double range = MagickCore::QuantumRange;
+            for (const TextRun* run : runs)
+            {
+                const double sr = run->color.quantumRed(), sg = run->color.quantumGreen(),
+                             sb = run->color.quantumBlue(),
+                             sa = run->color.quantumAlpha() / range;
+                for (const auto& g : run->glyphs)
+                {
+                    for (int row = 0; row < g.glyph->rows; ++row)
+                    {
+                        const ssize_t y = g.y + row;
+                        if (y < y0 || y >= y1)
+                            continue;
+                        for (int col = 0; col < g.glyph->width; ++col)
+                        {
+                            const ssize_t x = g.x + col;
+                            const unsigned char coverage =
+                                g.glyph->coverage[(size_t)row * g.glyph->width + col];
+                            if (x < 0 || x >= width || !coverage)
+                                continue;
+                            Magick::Quantum* p = pixels + ((y - y0) * width + x) * channels;
+                            // Over 合成：out = src * a + dst * da * (1 - a)
+                            const double a = coverage / 255.0 * sa;
+                            const double da = MagickCore::GetPixelAlpha(im, p) / range;
+                            const double oa = a + da * (1 - a);
+                            if (oa <= 0)
+                                continue;
+                            const double k = da * (1 - a);
+                            MagickCore::SetPixelRed(
+                                im,
+                                MagickCore::ClampToQuantum(
+                                    (sr * a + MagickCore::GetPixelRed(im, p) * k) / oa),
+                                p);
+                            MagickCore::SetPixelGreen(
+                                im,
+                                MagickCore::ClampToQuantum(
+                                    (sg * a + MagickCore::GetPixelGreen(im, p) * k) / oa),
+                                p);
+                            MagickCore::SetPixelBlue(
+                                im,
+                                MagickCore::ClampToQuantum(
+                                    (sb * a + MagickCore::GetPixelBlue(im, p) * k) / oa),
+                                p);
+                            MagickCore::SetPixelAlpha(
+                                im, MagickCore::ClampToQuantum(oa * range), p);
+                        }
+                    }
+                }
+            }
+            this->image.syncPixels();
+        }
+
+        // 在RGBA8画布上混合文字，与 Compositor 一样按预乘的 Over 合成
+        void BlendRasterText(const std::vector<const TextRun*>& runs)
+        {
+            Raster& raster = this->MutableRaster();
+            const ssize_t width = raster.Width(), height = raster.Height();
+            for (const TextRun* run : runs)
+            {
+                const uint32_t sr = QuantumTraits::ToChar(run->color.quantumRed()),
+                               sg = QuantumTraits::ToChar(run->color.quantumGreen()),
+                               sb = QuantumTraits::ToChar(run->color.quantumBlue()),
+                               sa = QuantumTraits::ToChar(run->color.quantumAlpha());
+                for (const auto& g : run->glyphs)
+                {
+                    for (int row = 0; row < g.glyph->rows; ++row)
+                    {
+                        const ssize_t y = g.y + row;
+                        if (y < 0 || y >= height)
+                            continue;
+                        uint8_t* line = raster.Row(y);
+                        for (int col = 0; col < g.glyph->width; ++col)
+                        {
+                            const ssize_t x = g.x + col;
+                            const uint32_t coverage =
+                                g.glyph->coverage[(size_t)row * g.glyph->width + col];
+                            if (x < 0 || x >= width || !coverage)
+                                continue;
+                            uint8_t* p = line + x * 4;
+                            const uint32_t a = Raster::Div255(coverage * sa);
+                            const uint32_t inv = 255 - a;
+                            p[0] = (uint8_t)(Raster::Div255(sr * a) + Raster::Div255(p[0] * inv));
+                            p[1] = (uint8_t)(Raster::Div255(sg * a) + Raster::Div255(p[1] * inv));
+                            p[2] = (uint8_t)(Raster::Div255(sb * a) + Raster::Div255(p[2] * inv));
+                            p[3] = (uint8_t)(a + Raster::Div255(p[3] * inv));
+                        }
+                    }
+                }
+            }
+        }
+
+        // 按格式设置压缩参数，format 为大写的格式名
+        void ApplyEncodeOptions(const std::string& format, const EncodeOptions& options)
+        {
+            static const int png_level[] = {1, 6, 9};
+            static const int png_filter[] = {1, 5, 5};
+            static const int lossy_quality[] = {80, 90, 100};
+            static const int webp_method[] = {0, 4, 6};
+            const int p = (int)options.profile;
+            if (format == "PNG")
+            {
+                // PNG的quality：十位为zlib压缩等级，个位为过滤器
+                this->image.quality(png_level[p] * 10 + png_filter[p]);
+                this->image.defineValue(
+                    "png", "compression-level", std::to_string(png_level[p]));
+                this->image.defineValue(
+                    "png", "compression-filter", std::to_string(png_filter[p]));
+                return;
+            }
+            int quality = options.quality >= 0 ? options.quality : lossy_quality[p];
+            this->image.quality(quality > 100 ? 100 : quality);
+            if (format == "WEBP")
+                this->image.defineValue("webp", "method", std::to_string(webp_method[p]));
+            else if (format == "JPEG")
+                this->image.defineValue(
+                    "jpeg", "optimize-coding", p == EncodeOptions::Fast ? "false" : "true");
+        }
+
         Magick::Image image;
+        // rasterized 为true时画布是 raster，否则是 image
+        Raster raster;
+        bool rasterized = false;
+        AssetCache* assets = &AssetCache::Global();
+        GlyphCache* glyphs = &GlyphCache::Global();
+        bool recording = false;
+        double scale = 1.0;
+        std::vector<DrawCommand> commands;
+        CanvasAccount canvas;
+        std::string phash, content_hash;
+        PHash binary_hash;
+        bool has_binary_hash = false;
     };
 } // namespace Sayobot
 
@@ -266,51 +4044,208 @@ string_t DoubleRound2(double a) {
     return ret;
 }
 
-std::string syb_background = "../png/stat/";
-std::string syb_edge = "../png/tk/";
-std::string syb_font = "../fonts/";
-std::string syb_skin = "../png/rank/";
-std::string syb_country = "../png/country/";
-std::string syb_global = "../png/world/s.png";
-std::string syb_avatar = "../png/avatars/";
+// 卡片布局的尺寸，所有坐标和字号都以它为准，按 scale 缩放后才是实际的像素
+static const size_t CARD_WIDTH = 1080, CARD_HEIGHT = 1920;
 
-struct {
-    std::string profile = "10014.ttf";
-    std::string data = "10014.ttf";
-    std::string sign = "10014.ttf";
-    std::string time = "10014.ttf";
-    std::string arrow = "10014.ttf";
-    std::string name = "10014.ttf";
-} syb_font_set;
+/*
+ * 渲染上下文：持有资源路径、字体、缓存和输出缓冲区
+ * 每个线程使用各自的上下文即可同时渲染；同一上下文的缓存可以被多个线程共享，
+ * 但路径和字体的修改、以及返回的结果字符串不是线程安全的
+ */
+struct Sayobot_Context {
+    std::string background = "../png/stat/";
+    std::string edge = "../png/tk/";
+    std::string font = "../fonts/";
+    std::string skin = "../png/rank/";
+    std::string country = "../png/country/";
+    std::string global = "../png/world/s.png";
+    std::string avatar = "../png/avatars/";
+    std::string opacity = "../png/";
+
+    struct {
+        std::string profile = "10014.ttf";
+        std::string data = "10014.ttf";
+        std::string sign = "10014.ttf";
+        std::string time = "10014.ttf";
+        std::string arrow = "10014.ttf";
+        std::string name = "10014.ttf";
+    } font_set;
+
+    Sayobot::EncodeOptions encode;
+    std::atomic<double> scale{1.0}; // 卡片的缩放比例，见 Sayobot_CtxSetScale；渲染开始时读取一次
+    Sayobot::AssetCache assets;
+    Sayobot::LayerCache layers;
+    Sayobot::GlyphCache glyphs;
+    Sayobot::OutputCache outputs;
+    std::shared_ptr<Sayobot::AvatarStore> avatars; // 由 Sayobot_CtxOpenAvatars 设置，原子地读写
+    string_t result;
+    string_t encode_value;
+    // 异步渲染的队列，放在最后：销毁上下文时最先析构，等排队的任务用完上面的资源
+    Sayobot::WorkQueue queue;
+};
+
+// 旧接口（不带上下文的导出函数）使用的默认上下文
+static Sayobot_Context* DefaultContext() {
+    static Sayobot_Context ctx;
+    return &ctx;
+}
 
 
 extern "C" {
 
+// 导出函数：创建渲染上下文，路径和字体为默认值
+SAYOBOT_API Sayobot_Context* Sayobot_CreateContext() {
+    return new Sayobot_Context();
+}
+
+// 导出函数：销毁渲染上下文，之前返回的结果字符串随之失效
+SAYOBOT_API void Sayobot_DestroyContext(Sayobot_Context* ctx) {
+    delete ctx;
+}
+
 #define SAYOBOT_SET(k, lv) if(!strcmp(key, k)) return (value ? ((lv) = value).c_str() : (lv).c_str());
 
+// 导出函数：设置上下文的路径
+SAYOBOT_API const char* Sayobot_CtxSetPath(Sayobot_Context* ctx, const char* key, const char* value) {
+	SAYOBOT_SET("background", ctx->background)
+    else SAYOBOT_SET("edge", ctx->edge)
+    else SAYOBOT_SET("font", ctx->font)
+    else SAYOBOT_SET("skin", ctx->skin)
+    else SAYOBOT_SET("country", ctx->country)
+    else SAYOBOT_SET("global", ctx->global)
+    else SAYOBOT_SET("avatar", ctx->avatar)
+    else SAYOBOT_SET("opacity", ctx->opacity)
+    else return NULL;
+}
+
+// 导出函数：设置上下文的字体
+SAYOBOT_API const char* Sayobot_CtxSetFont(Sayobot_Context* ctx, const char* key, const char* value) {
+    SAYOBOT_SET("profile", ctx->font_set.profile)
+    else SAYOBOT_SET("data", ctx->font_set.data)
+    else SAYOBOT_SET("sign", ctx->font_set.sign)
+    else SAYOBOT_SET("time", ctx->font_set.time)
+    else SAYOBOT_SET("arrow", ctx->font_set.arrow)
+    else SAYOBOT_SET("name", ctx->font_set.name)
+    else return NULL;
+}
+#undef SAYOBOT_SET
+
+// 导出函数：设置上下文缓存的字节预算，bytes小于0时仅查询；返回当前预算，未知的key返回-1
+SAYOBOT_API int64_t Sayobot_CtxSetCacheSize(Sayobot_Context* ctx, const char* key, int64_t bytes) {
+    if (!strcmp(key, "asset")) {
+        if (bytes >= 0) ctx->assets.SetCapacity((size_t)bytes);
+        return (int64_t)ctx->assets.Capacity();
+    }
+    if (!strcmp(key, "layer")) {
+        if (bytes >= 0) ctx->layers.SetCapacity((size_t)bytes);
+        return (int64_t)ctx->layers.Capacity();
+    }
+    if (!strcmp(key, "glyph")) {
+        if (bytes >= 0) ctx->glyphs.SetCapacity((size_t)bytes);
+        return (int64_t)ctx->glyphs.Capacity();
+    }
+    if (!strcmp(key, "output")) {
+        if (bytes >= 0) ctx->outputs.SetCapacity((size_t)bytes);
+        return (int64_t)ctx->outputs.Capacity();
+    }
+    return -1;
+}
+
+/*
+ * 导出函数：为上下文加载素材包（syb_pack 生成），之后的贴图优先从包中直接取得像素
+ * path 为NULL时卸载；返回包中的素材数，文件无法打开或格式不对时返回 -1
+ */
+SAYOBOT_API int64_t Sayobot_CtxLoadBundle(Sayobot_Context* ctx, const char* path) {
+    if (!path) {
+        ctx->assets.SetBundle(nullptr);
+        return 0;
+    }
+    std::shared_ptr<Sayobot::AssetBundle> bundle = Sayobot::AssetBundle::Open(path);
+    if (!bundle) return -1;
+    ctx->assets.SetBundle(bundle);
+    return (int64_t)bundle->Size();
+}
+
+/*
+ * 导出函数：设置输出缓存的有效期（毫秒），ms小于0时仅查询；返回当前的有效期
+ * 有效期内相同输入的卡片直接使用上一次的结果（页脚的时间也是上一次的），为0时关闭
+ * 默认为0：键不包含素材文件的修改，有效期内替换的背景、皮肤、头像文件不会反映到卡片上，
+ * 需要由调用方按自己能接受的延迟开启
+ */
+SAYOBOT_API int64_t Sayobot_CtxSetOutputTtl(Sayobot_Context* ctx, int64_t ms) {
+    if (ms >= 0) ctx->outputs.SetTtl(ms);
+    return ctx->outputs.Ttl();
+}
+
+/*
+ * 导出函数：设置卡片的缩放比例，scale 小于等于0时仅查询；返回当前的比例
+ * 卡片直接按比例渲染（0.5 为 540x960），素材按缩放后的尺寸取得，文字按缩放后的字号栅格化，
+ * 不需要先画原尺寸再缩小；不同比例的底层画布和输出分别缓存
+ */
+SAYOBOT_API double Sayobot_CtxSetScale(Sayobot_Context* ctx, double scale) {
+    if (scale > 0) ctx->scale.store(scale);
+    return ctx->scale.load();
+}
+
+/*
+ * 导出函数：按目标尺寸设置缩放比例，卡片放得下 width x height 且保持比例
+ * 其中一个为0时只按另一个计算，都为0时恢复原尺寸；返回设置后的比例
+ */
+SAYOBOT_API double Sayobot_CtxSetTargetSize(Sayobot_Context* ctx, unsigned width, unsigned height) {
+    double scale = 1.0;
+    if (width && height)
+        scale = std::min((double)width / CARD_WIDTH, (double)height / CARD_HEIGHT);
+    else if (width)
+        scale = (double)width / CARD_WIDTH;
+    else if (height)
+        scale = (double)height / CARD_HEIGHT;
+    return Sayobot_CtxSetScale(ctx, scale);
+}
+
+/*
+ * 导出函数：设置上下文的默认编码参数，value为NULL时仅查询
+ *** profile fast、balanced 或 archival
+ *** quality JPEG/WebP 的质量，-1 表示使用档位的默认值
+ * 返回设置后的值，未知的key或非法的value返回NULL
+ */
+SAYOBOT_API const char* Sayobot_CtxSetEncode(Sayobot_Context* ctx, const char* key, const char* value) {
+    if (!strcmp(key, "profile")) {
+        if (value && !Sayobot::EncodeOptions::ParseProfile(value, ctx->encode.profile))
+            return NULL;
+        ctx->encode_value = Sayobot::EncodeOptions::ProfileName(ctx->encode.profile);
+    } else if (!strcmp(key, "quality")) {
+        if (value) {
+            char* end;
+            long quality = strtol(value, &end, 10);
+            if (*end || end == value || quality < -1 || quality > 100) return NULL;
+            ctx->encode.quality = (int)quality;
+        }
+        ctx->encode_value = std::to_string(ctx->encode.quality);
+    } else {
+        return NULL;
+    }
+    return ctx->encode_value.c_str();
+}
+
 // 导出函数：设置路径
 SAYOBOT_API const char* Sayobot_SetPath(const char* key, const char* value) {
-	SAYOBOT_SET("background", syb_background)
-    else SAYOBOT_SET("edge", syb_edge)
-    else SAYOBOT_SET("font", syb_font)
-    else SAYOBOT_SET("skin", syb_skin)
-    else SAYOBOT_SET("country", syb_country)
-    else SAYOBOT_SET("global", syb_global)
-    else SAYOBOT_SET("avatar", syb_avatar)
-    else return NULL;
+    return Sayobot_CtxSetPath(DefaultContext(), key, value);
 }
 
 // 导出函数：设置字体
 SAYOBOT_API const char* Sayobot_SetFont(const char* key, const char* value) {
-    SAYOBOT_SET("profile", syb_font_set.profile)
-    else SAYOBOT_SET("data", syb_font_set.data)
-    else SAYOBOT_SET("sign", syb_font_set.sign)
-    else SAYOBOT_SET("time", syb_font_set.time)
-    else SAYOBOT_SET("arrow", syb_font_set.arrow)
-    else SAYOBOT_SET("name", syb_font_set.name)
-    else return NULL;
+    return Sayobot_CtxSetFont(DefaultContext(), key, value);
+}
+
+// 导出函数：设置缓存的字节预算，bytes小于0时仅查询；返回当前预算，未知的key返回-1
+SAYOBOT_API int64_t Sayobot_SetCacheSize(const char* key, int64_t bytes) {
+    return Sayobot_CtxSetCacheSize(DefaultContext(), key, bytes);
+}
+
+// 导出函数：设置默认编码参数
+SAYOBOT_API const char* Sayobot_SetEncode(const char* key, const char* value) {
+    return Sayobot_CtxSetEncode(DefaultContext(), key, value);
 }
-#undef SAYOBOT_SET
 
 // 导出函数：以路径初始化（仅在Windows上或者部分Mac OS上需要）
 SAYOBOT_API void Sayobot_LoadMagic(const char* path) {
@@ -400,108 +4335,490 @@ SAYOBOT_API void UserStatData_destroy(UserStatData* src) {
     Sayobot_Free(src->country);
 }
 
-SAYOBOT_API struct user_info {
-    int user_id;
-    char* username = nullptr;
-    long registed_timestamp;
-    int n300, n100, n50;
-    int playcount;
-    int64_t total_score, ranked_score;
-    int64_t total_hits;
-    float pp;
-    int country_rank, global_rank;
-    int count_ssh, count_ss, count_sh, count_s, count_a;
-    int playtime;
-    float level;
-    double accuracy;
-    char* country = nullptr;
+SAYOBOT_API struct user_info {
+    int user_id;
+    char* username = nullptr;
+    long registed_timestamp;
+    int n300, n100, n50;
+    int playcount;
+    int64_t total_score, ranked_score;
+    int64_t total_hits;
+    float pp;
+    int country_rank, global_rank;
+    int count_ssh, count_ss, count_sh, count_s, count_a;
+    int playtime;
+    float level;
+    double accuracy;
+    char* country = nullptr;
+
+};
+
+SAYOBOT_API void user_info_destory(user_info* src) {
+    Sayobot_Free(src->username);
+    Sayobot_Free(src->country);
+}
+
+SAYOBOT_API struct UserPanelData {
+    mode_enum mode;
+    user_info uinfo;
+    UserConfigData config;
+    UserStatData stat;
+    int compareDays;
+};
+
+/*
+ * UserPanelData 的深拷贝：字符串复制到 strings 中，data 里的指针指向这些副本
+ * 异步渲染在调用返回之后才进行，不能引用调用方的内存
+ */
+struct PanelDataCopy {
+    UserPanelData data;
+    std::list<std::string> strings; // list 中元素的地址不会改变
+
+    explicit PanelDataCopy(const UserPanelData& src) : data(src) {
+        UserConfigData& c = data.config;
+        for (char** str : {&data.uinfo.username, &data.uinfo.country, &c.username, &c.sign,
+                           &c.background, &c.edge.profile, &c.edge.data, &c.edge.sign,
+                           &c.color.profile, &c.color.data, &c.color.sign, &c.color.time,
+                           &c.color.arrowup, &c.color.arrowdown, &c.color.name, &c.skin,
+                           &data.stat.username, &data.stat.country}) {
+            if (!*str) continue;
+            strings.emplace_back(*str);
+            *str = &strings.back()[0];
+        }
+    }
+
+    PanelDataCopy(const PanelDataCopy&) = delete;
+    PanelDataCopy& operator=(const PanelDataCopy&) = delete;
+};
+
+/*
+ * UserPanelData 的扁平二进制形式（版本1）：固定的头部之后是字符串表，整个卡片数据是一块连续的内存
+ * 字符串字段为从缓冲区开头算起的偏移（0 表示NULL），指向以\0结尾的字符串
+ * 数值为主机字节序（x86/ARM 为小端）；header_size 为头部的大小，之后的版本只在头部末尾增加字段
+ * 渲染时直接引用缓冲区中的字符串，不复制、不分配，也不需要释放各个字段
+ * 卡片上用到的字符串（用户名、签名、背景、框框、颜色、皮肤）不能为NULL，
+ * 签名最长 SAYOBOT_FLAT_TEXT_MAX 字节，其余字符串最长 SAYOBOT_FLAT_NAME_MAX 字节
+ * 批量接口的缓冲区为多个扁平数据首尾相连，每个的 size 补齐到8的倍数
+ */
+struct Sayobot_FlatPanel {
+    char magic[4]; // "SYBF"
+    uint16_t version;
+    uint16_t header_size;
+    uint32_t size; // 头部加字符串表的总字节数
+    int32_t mode;
+    int32_t compare_days;
+    uint32_t reserved;
+
+    // 8字节的字段
+    int64_t u_registed_timestamp, u_total_score, u_ranked_score, u_total_hits;
+    double u_accuracy;
+    int64_t c_qq;
+    int64_t s_qq, s_total_score, s_ranked_score;
+    double s_accuracy;
+    int64_t s_playcount, s_update_timestamp;
+
+    // user_info
+    int32_t u_user_id, u_n300, u_n100, u_n50, u_playcount;
+    float u_pp;
+    int32_t u_country_rank, u_global_rank;
+    int32_t u_count_ssh, u_count_ss, u_count_sh, u_count_s, u_count_a, u_playtime;
+    float u_level;
+    uint32_t u_username, u_country;
+
+    // UserConfigData
+    int32_t c_user_id, c_opacity;
+    uint32_t c_username, c_sign, c_background;
+    uint32_t c_edge_profile, c_edge_data, c_edge_sign;
+    uint32_t c_color_profile, c_color_data, c_color_sign, c_color_time;
+    uint32_t c_color_arrowup, c_color_arrowdown, c_color_name;
+    uint32_t c_skin;
+
+    // UserStatData
+    int32_t s_user_id, s_total_hit;
+    float s_pp, s_level;
+    int32_t s_global_rank, s_country_rank;
+    int32_t s_xh, s_x, s_sh, s_s, s_a;
+    int32_t s_mode;
+    uint32_t s_days;
+    uint32_t s_username, s_country;
+};
+static_assert(sizeof(Sayobot_FlatPanel) == 312, "Sayobot_FlatPanel layout changed");
+
+static const uint16_t SAYOBOT_FLAT_VERSION = 1;
+static const size_t SAYOBOT_FLAT_NAME_MAX = 255;
+static const size_t SAYOBOT_FLAT_TEXT_MAX = 1023;
+
+/*
+ * 把扁平数据解释为 UserPanelData，字符串指向缓冲区内部（缓冲区在渲染期间必须有效）
+ * 检查头部、各字符串的偏移、结尾的\0、长度和必须有的字符串，不合法时返回false；
+ * size 为这份数据的字节数
+ */
+static bool PanelDataView(const void* buf, size_t len, UserPanelData& out, size_t* size = NULL) {
+    Sayobot_FlatPanel f;
+    if (!buf || len < sizeof(f)) return false;
+    memcpy(&f, buf, sizeof(f)); // 缓冲区不一定对齐
+    if (memcmp(f.magic, "SYBF", 4) || f.version != SAYOBOT_FLAT_VERSION
+        || f.header_size < sizeof(f) || f.size < f.header_size || f.size > len
+        || f.mode < _std || f.mode > mania || f.s_mode < _std || f.s_mode > mania)
+        return false;
+    const char* base = (const char*)buf;
+    // 字符串表在头部之后，并且以\0结尾，所以每个字符串都在缓冲区内结束
+    if (f.size > f.header_size && base[f.size - 1] != '\0') return false;
+    bool ok = true;
+    // 渲染时直接使用的字符串（拼接路径、画文字）不能为NULL，长度也要有上限
+    auto str = [&](uint32_t offset, bool required = false,
+                   size_t max = SAYOBOT_FLAT_NAME_MAX) -> char* {
+        if (!offset) {
+            ok = ok && !required;
+            return NULL;
+        }
+        if (offset < f.header_size || offset >= f.size
+            || strnlen(base + offset, f.size - offset) > max) {
+            ok = false;
+            return NULL;
+        }
+        return const_cast<char*>(base + offset);
+    };
+
+    out = UserPanelData();
+    out.mode = (mode_enum)f.mode;
+    out.compareDays = f.compare_days;
+
+    user_info& u = out.uinfo;
+    u.user_id = f.u_user_id;
+    u.username = str(f.u_username, true);
+    u.registed_timestamp = (long)f.u_registed_timestamp;
+    u.n300 = f.u_n300;
+    u.n100 = f.u_n100;
+    u.n50 = f.u_n50;
+    u.playcount = f.u_playcount;
+    u.total_score = f.u_total_score;
+    u.ranked_score = f.u_ranked_score;
+    u.total_hits = f.u_total_hits;
+    u.pp = f.u_pp;
+    u.country_rank = f.u_country_rank;
+    u.global_rank = f.u_global_rank;
+    u.count_ssh = f.u_count_ssh;
+    u.count_ss = f.u_count_ss;
+    u.count_sh = f.u_count_sh;
+    u.count_s = f.u_count_s;
+    u.count_a = f.u_count_a;
+    u.playtime = f.u_playtime;
+    u.level = f.u_level;
+    u.accuracy = f.u_accuracy;
+    u.country = str(f.u_country);
+
+    UserConfigData& c = out.config;
+    c.user_id = f.c_user_id;
+    c.qq = f.c_qq;
+    c.username = str(f.c_username);
+    c.sign = str(f.c_sign, true, SAYOBOT_FLAT_TEXT_MAX);
+    c.background = str(f.c_background, true);
+    c.edge.profile = str(f.c_edge_profile, true);
+    c.edge.data = str(f.c_edge_data, true);
+    c.edge.sign = str(f.c_edge_sign, true);
+    c.color.profile = str(f.c_color_profile, true);
+    c.color.data = str(f.c_color_data, true);
+    c.color.sign = str(f.c_color_sign, true);
+    c.color.time = str(f.c_color_time, true);
+    c.color.arrowup = str(f.c_color_arrowup, true);
+    c.color.arrowdown = str(f.c_color_arrowdown, true);
+    c.color.name = str(f.c_color_name, true);
+    c.skin = str(f.c_skin, true);
+    c.opacity = f.c_opacity;
+
+    UserStatData& s = out.stat;
+    s.user_id = f.s_user_id;
+    s.qq = f.s_qq;
+    s.username = str(f.s_username);
+    s.total_score = f.s_total_score;
+    s.ranked_score = f.s_ranked_score;
+    s.total_hit = f.s_total_hit;
+    s.accuracy = f.s_accuracy;
+    s.pp = f.s_pp;
+    s.level = f.s_level;
+    s.global_rank = f.s_global_rank;
+    s.country_rank = f.s_country_rank;
+    s.country = str(f.s_country);
+    s.playcount = f.s_playcount;
+    s.xh = f.s_xh;
+    s.x = f.s_x;
+    s.sh = f.s_sh;
+    s.s = f.s_s;
+    s.a = f.s_a;
+    s.update_timestamp = (time_t)f.s_update_timestamp;
+    s.mode = (mode_enum)f.s_mode;
+    s.days = f.s_days;
+
+    if (size) *size = f.size;
+    return ok;
+}
+
+// 把 UserPanelData 写成扁平形式，返回需要的字节数；cap 不够时只返回大小，不写入
+static size_t FlattenPanelData(const UserPanelData& data, void* buf, size_t cap) {
+    Sayobot_FlatPanel f;
+    memset(&f, 0, sizeof(f));
+    std::string strings;
+    auto str = [&](const char* value) -> uint32_t {
+        if (!value) return 0;
+        const uint32_t offset = (uint32_t)(sizeof(f) + strings.size());
+        strings.append(value, strlen(value) + 1);
+        return offset;
+    };
+
+    memcpy(f.magic, "SYBF", 4);
+    f.version = SAYOBOT_FLAT_VERSION;
+    f.header_size = sizeof(f);
+    f.mode = data.mode;
+    f.compare_days = data.compareDays;
+
+    const user_info& u = data.uinfo;
+    f.u_user_id = u.user_id;
+    f.u_username = str(u.username);
+    f.u_registed_timestamp = u.registed_timestamp;
+    f.u_n300 = u.n300;
+    f.u_n100 = u.n100;
+    f.u_n50 = u.n50;
+    f.u_playcount = u.playcount;
+    f.u_total_score = u.total_score;
+    f.u_ranked_score = u.ranked_score;
+    f.u_total_hits = u.total_hits;
+    f.u_pp = u.pp;
+    f.u_country_rank = u.country_rank;
+    f.u_global_rank = u.global_rank;
+    f.u_count_ssh = u.count_ssh;
+    f.u_count_ss = u.count_ss;
+    f.u_count_sh = u.count_sh;
+    f.u_count_s = u.count_s;
+    f.u_count_a = u.count_a;
+    f.u_playtime = u.playtime;
+    f.u_level = u.level;
+    f.u_accuracy = u.accuracy;
+    f.u_country = str(u.country);
+
+    const UserConfigData& c = data.config;
+    f.c_user_id = c.user_id;
+    f.c_qq = c.qq;
+    f.c_username = str(c.username);
+    f.c_sign = str(c.sign);
+    f.c_background = str(c.background);
+    f.c_edge_profile = str(c.edge.profile);
+    f.c_edge_data = str(c.edge.data);
+    f.c_edge_sign = str(c.edge.sign);
+    f.c_color_profile = str(c.color.profile);
+    f.c_color_data = str(c.color.data);
+    f.c_color_sign = str(c.color.sign);
+    f.c_color_time = str(c.color.time);
+    f.c_color_arrowup = str(c.color.arrowup);
+    f.c_color_arrowdown = str(c.color.arrowdown);
+    f.c_color_name = str(c.color.name);
+    f.c_skin = str(c.skin);
+    f.c_opacity = c.opacity;
+
+    const UserStatData& s = data.stat;
+    f.s_user_id = s.user_id;
+    f.s_qq = s.qq;
+    f.s_username = str(s.username);
+    f.s_total_score = s.total_score;
+    f.s_ranked_score = s.ranked_score;
+    f.s_total_hit = s.total_hit;
+    f.s_accuracy = s.accuracy;
+    f.s_pp = s.pp;
+    f.s_level = s.level;
+    f.s_global_rank = s.global_rank;
+    f.s_country_rank = s.country_rank;
+    f.s_country = str(s.country);
+    f.s_playcount = s.playcount;
+    f.s_xh = s.xh;
+    f.s_x = s.x;
+    f.s_sh = s.sh;
+    f.s_s = s.s;
+    f.s_a = s.a;
+    f.s_update_timestamp = s.update_timestamp;
+    f.s_mode = s.mode;
+    f.s_days = s.days;
+
+    f.size = (uint32_t)(sizeof(f) + strings.size());
+    if (buf && cap >= f.size) {
+        memcpy(buf, &f, sizeof(f));
+        memcpy((char*)buf + sizeof(f), strings.data(), strings.size());
+    }
+    return f.size;
+}
+
+/*
+ * 卡片渲染输入的规范哈希：上下文的路径和字体 + UserPanelData 中所有会画到卡片上的字段
+ * 逐字段加入（不受结构体填充字节影响），不包含页脚的当前时间和各种更新时间戳
+ * stat 的字段无论有没有对比数据（user_id == -1）都要加入：Total Hits 总是用到 total_hit 和 country_rank
+ */
+static void HashPanelData(Sayobot::Hasher& h, const Sayobot_Context* ctx, const UserPanelData* data) {
+    for (const std::string* path : {&ctx->background, &ctx->edge, &ctx->font, &ctx->skin,
+                                    &ctx->country, &ctx->global, &ctx->avatar, &ctx->opacity,
+                                    &ctx->font_set.profile, &ctx->font_set.data, &ctx->font_set.sign,
+                                    &ctx->font_set.time, &ctx->font_set.arrow, &ctx->font_set.name})
+        h.Add(*path);
+    h.Add((int32_t)data->mode);
+    h.Add((int32_t)data->compareDays);
 
-};
+    const user_info& u = data->uinfo;
+    h.Add(u.user_id);
+    if (std::shared_ptr<Sayobot::AvatarStore> avatars = std::atomic_load(&ctx->avatars))
+        h.Add(avatars->Revision(u.user_id));
+    h.Add(u.username);
+    h.Add(u.country);
+    for (int v : {u.n300, u.n100, u.n50, u.playcount, u.country_rank, u.global_rank,
+                  u.count_ssh, u.count_ss, u.count_sh, u.count_s, u.count_a})
+        h.Add(v);
+    h.Add(u.ranked_score);
+    h.Add(u.pp);
+    h.Add(u.level);
+    h.Add(u.accuracy);
 
-SAYOBOT_API void user_info_destory(user_info* src) {
-    Sayobot_Free(src->username);
-    Sayobot_Free(src->country);
+    const UserConfigData& c = data->config;
+    h.Add(c.qq);
+    h.Add(c.opacity);
+    for (const char* str : {c.sign, c.background, c.edge.profile, c.edge.data, c.edge.sign,
+                            c.color.profile, c.color.data, c.color.sign, c.color.time,
+                            c.color.arrowup, c.color.arrowdown, c.color.name, c.skin})
+        h.Add(str);
+
+    const UserStatData& st = data->stat;
+    h.Add(st.user_id);
+    h.Add(st.ranked_score);
+    h.Add(st.playcount);
+    h.Add(st.accuracy);
+    h.Add(st.pp);
+    h.Add(st.level);
+    for (int32_t v : {st.total_hit, st.global_rank, st.country_rank,
+                      st.xh, st.x, st.sh, st.s, st.a})
+        h.Add(v);
 }
 
-SAYOBOT_API struct UserPanelData {
-    mode_enum mode;
-    user_info uinfo;
-    UserConfigData config;
-    UserStatData stat;
-    int compareDays;
-};
+/*
+ * 取得卡片的底层：背景、不透明贴图、三种框框和rank图标
+ * 这些只取决于用户配置，合成结果缓存在上下文的 LayerCache 中
+ * 模式图标和地球图标与头像重叠，必须画在头像之上，因此不放入底层
+ */
+static Sayobot::Image BaseLayer(Sayobot_Context* ctx, const UserPanelData* data, double scale) {
+    const std::vector<string_t> rank_str = {"/ranking-X-small.png",
+                                                "/ranking-XH-small.png",
+                                                "/ranking-S-small.png",
+                                                "/ranking-SH-small.png",
+                                                "/ranking-A-small.png"};
+    char stemp[512];
+    std::vector<string_t> paths;
+    snprintf(stemp, sizeof(stemp), "%s%s", ctx->background.c_str(), data->config.background);
+    paths.push_back(stemp);
+    snprintf(stemp, sizeof(stemp), "%sfx%d.png", ctx->opacity.c_str(), data->config.opacity);
+    paths.push_back(stemp);
+    snprintf(stemp, sizeof(stemp), "%s%s", ctx->edge.c_str(), data->config.edge.profile);
+    paths.push_back(stemp);
+    snprintf(stemp, sizeof(stemp), "%s%s", ctx->edge.c_str(), data->config.edge.data);
+    paths.push_back(stemp);
+    snprintf(stemp, sizeof(stemp), "%s%s", ctx->edge.c_str(), data->config.edge.sign);
+    paths.push_back(stemp);
+    for (int i = 0; i < 5; ++i) {
+        snprintf(stemp, sizeof(stemp), "%s%s%s", ctx->skin.c_str(), data->config.skin,
+                 rank_str[i].c_str());
+        paths.push_back(stemp);
+    }
 
-// 导出函数：制作卡片，输出路径必须要带有后缀名和路径（之前默认输出到data/image下）
-SAYOBOT_API const char* MakePersonalCard(const UserPanelData* data, const char* out_path) {
+    string_t key = std::to_string(scale) + '\n';
+    for (const auto& path : paths) {
+        key += path;
+        key += '\n';
+    }
+    Sayobot::Raster cached;
+    if (ctx->layers.Get(key, cached)) {
+        Sayobot::Image image(cached);
+        image.SetAssetCache(&ctx->assets);
+        image.SetScale(scale);
+        return image;
+    }
+
+    Sayobot::LayerCache::Dependencies deps;
+    for (const auto& path : paths)
+        deps.emplace_back(path, Sayobot::LayerCache::FileMtime(path));
+
+    Sayobot::Image image;
+    image.SetAssetCache(&ctx->assets);
+    image.SetScale(scale);
+    image.Create(CARD_WIDTH, CARD_HEIGHT);
+    image.BeginRecord();
+    // 绘制背景
+    image.DrawPic(paths[0], 0, 0);
+    // 不透明贴图
+    image.DrawPic(paths[1], 0, 0);
+    // 绘制个人信息框
+    image.DrawPic(paths[2], 50, 20, 970, 600);
+    // 绘制数据框（六个框共用一次缩放的结果）
+    const Sayobot::Raster frame = image.Sprite(paths[3], 820, 140);
+    for (int i = 0; i < 6; ++i)
+        image.DrawSprite(frame, 56 + 33.5 * i, 980 + 140 * i);
+    // 绘制签名框
+    image.DrawPic(paths[4], 125, 570, 825, 150);
+    // 绘制rank图标
+    for (int i = 0; i < 5; ++i)
+        image.DrawPic(paths[5 + i], 165 + 120 * i, i % 2 ? 870 : 720, 82, 98);
+
+    ctx->layers.Put(key, image.GetRaster(), deps);
+    return image;
+}
+
+// 录制卡片的内容，由 RenderCard 调用
+static Sayobot::Image DrawCard(Sayobot_Context* ctx, const UserPanelData* data, double scale) {
     const std::vector<string_t> mode_str = {"/mode-osu-med.png",
                                                 "/mode-taiko-med.png",
                                                 "/mode-fruits-med.png",
                                                 "/mode-mania-med.png"};
-    const std::vector<string_t> rank_str = {"/ranking-X-small.png",
-                                                "/ranking-XH-small.png",
-                                                "/ranking-S-small.png",
-                                                "/ranking-SH-small.png",
-                                                "/ranking-A-small.png"};               
-            
+
         char stemp[512];
         int64_t itemp;
         float ftemp;
         double dtemp;
-        Sayobot::Image image;
-        image.Create(1080, 1920);
+        Sayobot::Image image = BaseLayer(ctx, data, scale);
+        image.SetGlyphCache(&ctx->glyphs);
+        image.BeginRecord();
 #pragma region drawing
-        // 绘制背景
-        sprintf(stemp, "%s%s", syb_background.c_str(), data->config.background);
-        image.DrawPic(stemp, 0, 0);
-        // 不透明贴图
-        sprintf(stemp, "../png/fx%d.png", data->config.opacity);
-        image.DrawPic(stemp, 0, 0);
-        // 绘制个人信息框
-        sprintf(stemp, "%s%s", syb_edge.c_str(), data->config.edge.profile);
-        image.DrawPic(stemp, 50, 20, 970, 600);
-        // 绘制数据框
-        for (int i = 0; i < 6; ++i) {
-            sprintf(stemp, "%s%s", syb_edge.c_str(), data->config.edge.data);
-            image.DrawPic(stemp, 56 + 33.5 * i, 980 + 140 * i, 820, 140);
-        }
-
-        // 绘制签名框
-        sprintf(stemp, "%s%s", syb_edge.c_str(), data->config.edge.sign);
-        image.DrawPic(stemp, 125, 570, 825, 150);
         // 绘制头像
-        sprintfS(stemp, 512, "%s%d.png", syb_avatar.c_str(), data->uinfo.user_id);
-        try {
-            image.DrawPic(stemp, 165, 150, 350, 350);
-        } catch (Magick::Exception &ex) {
-            image.DrawPic(syb_avatar + "no-avatar.png", 165, 150, 350, 350);
+        // 优先使用头像库（库中是原尺寸的头像）；不在库中时读取头像文件，
+        // 文件不存在时不再抛出异常，直接使用默认头像
+        std::shared_ptr<Sayobot::AvatarStore> avatars = std::atomic_load(&ctx->avatars);
+        Sayobot::Raster avatar;
+        struct stat st;
+        snprintf(stemp, sizeof(stemp), "%s%d.png", ctx->avatar.c_str(), data->uinfo.user_id);
+        if (avatars && scale == 1.0 && avatars->Find(data->uinfo.user_id, avatar)) {
+            image.DrawSprite(avatar, 165, 150);
+        } else if (stat(stemp, &st) == 0) {
+            try {
+                image.DrawPic(stemp, 165, 150, 350, 350);
+            } catch (Magick::Exception &ex) {
+                image.DrawPic(ctx->avatar + "no-avatar.png", 165, 150, 350, 350);
+            }
+        } else {
+            image.DrawPic(ctx->avatar + "no-avatar.png", 165, 150, 350, 350);
         }
         // 绘制模式图标
-        sprintf(stemp,
-                "%s%s%s",
-                syb_skin.c_str(),
-                data->config.skin,
-                mode_str[(int)data->mode].c_str());
+        snprintf(stemp,
+                 sizeof(stemp),
+                 "%s%s%s",
+                 ctx->skin.c_str(),
+                 data->config.skin,
+                 mode_str[(int)data->mode].c_str());
         image.DrawPic(stemp, 165, 150, 80, 80);
         // 绘制地球图标
-        image.DrawPic(syb_global, 510, 150, 100, 100);
+        image.DrawPic(ctx->global, 510, 150, 100, 100);
         // 绘制国旗
-        sprintf(stemp,
-                "%s%s.png", syb_country.c_str(),
-                (data->uinfo.country && *data->uinfo.country) ? data->uinfo.country : "__");
+        snprintf(stemp,
+                 sizeof(stemp),
+                 "%s%s.png", ctx->country.c_str(),
+                 (data->uinfo.country && *data->uinfo.country) ? data->uinfo.country : "__");
         image.DrawPic(stemp, 560, 425, 80, 80);
 
-        // 绘制rank图标
-        for (int i = 0; i < 5; ++i) {
-            sprintf(stemp,
-                    "%s%s%s", syb_skin.c_str(),
-                    data->config.skin,
-                    rank_str[i].c_str());
-            image.DrawPic(stemp, 165 + 120 * i, i % 2 ? 870 : 720, 82, 98);
-        }
         Sayobot::TextStyle ts;
         // 绘制天数
         ts.color = data->config.color.time;
-        ts.font_family = syb_font; ts.font_family += syb_font_set.time;
+        ts.font_family = ctx->font; ts.font_family += ctx->font_set.time;
         ts.pointsize = SMALL_POINTSIZE;
         if (data->compareDays != 0) {
             sprintfS(stemp, 512, "compare with %u days ago", data->compareDays);
@@ -510,12 +4827,13 @@ SAYOBOT_API const char* MakePersonalCard(const UserPanelData* data, const char*
         // 绘制时间
         time_t tt;
         time(&tt);
-        strftime(
-            stemp, 512, "%F %a %T by Sayobot with C++ & Magick++", localtime(&tt));
+        struct tm tm;
+        localtimeS(&tm, &tt);
+        strftime(stemp, 512, "%F %a %T by Sayobot with C++ & Magick++", &tm);
         image.Drawtext(stemp, ts, 30, 1880);
         // 绘制UID
         ts.color = data->config.color.profile;
-        ts.font_family = syb_font; ts.font_family += syb_font_set.profile;
+        ts.font_family = ctx->font; ts.font_family += ctx->font_set.profile;
         ts.pointsize = SMALL_POINTSIZE;
         sprintf(stemp, "UID: %d", data->uinfo.user_id);
         image.Drawtext(stemp, ts, 585, 365);
@@ -530,7 +4848,7 @@ SAYOBOT_API const char* MakePersonalCard(const UserPanelData* data, const char*
         // 绘制国家/地区排名
         itemp = data->uinfo.country_rank - data->stat.country_rank;
         ts.color = data->config.color.profile;
-        ts.font_family = syb_font; ts.font_family += syb_font_set.profile;
+        ts.font_family = ctx->font; ts.font_family += ctx->font_set.profile;
         ts.pointsize = SMALL_POINTSIZE;
         if (data->stat.user_id == -1) {
             sprintfS(stemp, 512, "#%d", data->uinfo.country_rank);
@@ -546,7 +4864,7 @@ SAYOBOT_API const char* MakePersonalCard(const UserPanelData* data, const char*
 
         // 设置Data区块字体
         ts.color = data->config.color.data;
-        ts.font_family = syb_font; ts.font_family += syb_font_set.data;
+        ts.font_family = ctx->font; ts.font_family += ctx->font_set.data;
         ts.pointsize = MID_POINTSIZE;
         // 绘制pp
         sprintf(stemp, "PPoint :     %.2f", data->uinfo.pp);
@@ -638,7 +4956,7 @@ SAYOBOT_API const char* MakePersonalCard(const UserPanelData* data, const char*
             image.Drawtext(stemp, ts, 814, 1770);
             // 绘制rank差值
             ts.color = data->config.color.name;
-            ts.font_family = syb_font; ts.font_family += syb_font_set.name;
+            ts.font_family = ctx->font; ts.font_family += ctx->font_set.name;
             ts.pointsize = BIG_POINTSIZE;
             itemp = data->uinfo.count_ssh + data->uinfo.count_ss - data->stat.xh
                     - data->stat.x;
@@ -687,30 +5005,1092 @@ SAYOBOT_API const char* MakePersonalCard(const UserPanelData* data, const char*
                     itemp < 0 ? -itemp : itemp);
             ts.color = itemp > 0 ? data->config.color.arrowdown
                                     : data->config.color.arrowup;
-            ts.font_family = syb_font; ts.font_family += syb_font_set.arrow;
+            ts.font_family = ctx->font; ts.font_family += ctx->font_set.arrow;
             image.Drawtext(stemp, ts, 660, 270);
         }
 
         // 绘制全球排名
         ts.color = data->config.color.name;
-        ts.font_family = syb_font; ts.font_family += syb_font_set.name;
+        ts.font_family = ctx->font; ts.font_family += ctx->font_set.name;
         image.Drawtext(std::to_string(data->uinfo.global_rank), ts, 600, 220);
         // 绘制名字
         image.Drawtext(data->uinfo.username, ts, 555, 325);
         // 绘制签名
         ts.color = data->config.color.sign;
-        ts.font_family = syb_font; ts.font_family += syb_font_set.sign;
+        ts.font_family = ctx->font; ts.font_family += ctx->font_set.sign;
         ts.gravity = MagickCore::GravityType::NorthGravity;
         ts.align = MagickCore::AlignType::CenterAlign;
         image.Drawtext(data->config.sign, ts, 540, 660);
 #pragma endregion
-        image.Save(out_path);
+        return image;
+}
+
+// 目录下的文件名（directories为true时为子目录名），按名字排序；目录不存在时为空
+static std::vector<std::string> ListDir(const std::string& dir, bool directories) {
+    std::vector<std::string> names;
+#ifndef WIN32
+    DIR* d = opendir(dir.c_str());
+    if (!d) return names;
+    while (dirent* entry = readdir(d)) {
+        const std::string name = entry->d_name;
+        struct stat st;
+        if (name[0] == '.' || stat((dir + "/" + name).c_str(), &st) != 0) continue;
+        if (directories ? S_ISDIR(st.st_mode) : S_ISREG(st.st_mode)) names.push_back(name);
+    }
+    closedir(d);
+#else
+    _finddata_t data;
+    intptr_t handle = _findfirst((dir + "/*").c_str(), &data);
+    if (handle == -1) return names;
+    do {
+        if (data.name[0] != '.' && !(data.attrib & _A_SUBDIR) != directories)
+            names.push_back(data.name);
+    } while (_findnext(handle, &data) == 0);
+    _findclose(handle);
+#endif
+    std::sort(names.begin(), names.end());
+    return names;
+}
+
+// 卡片素材的种类，CollectCardAssets 的 kinds 为它们的组合
+enum CardAssetKind {
+    CARD_ASSET_GLOBAL = 1,
+    CARD_ASSET_SKIN = 2,
+    CARD_ASSET_COUNTRY = 4,
+    CARD_ASSET_EDGE = 8,
+    CARD_ASSET_OPACITY = 16,
+    CARD_ASSET_AVATAR = 32,
+    CARD_ASSET_BACKGROUND = 64
+};
+
+// 卡片用到的一个素材：种类、路径、按比例换算后 DrawPic 请求的尺寸，以及配置中的名字（文件名，皮肤为目录名）
+struct CardAsset {
+    int kind;
+    std::string path;
+    size_t width, height;
+    std::string name;
+};
+
+/*
+ * 列出上下文的路径下卡片会用到的素材，尺寸与 BaseLayer、DrawCard 中的 DrawPic 一致，
+ * 并按 scale 换算（与 Image::Sprite 相同），使预加载和素材包的键与渲染时一致
+ * 不指定尺寸的素材在 scale 不为1时按原尺寸换算，无法识别的文件保留为不指定尺寸
+ * 按 kinds 的顺序：小的图标在前，背景在最后
+ */
+static void CollectCardAssets(const Sayobot_Context* ctx, int kinds, std::vector<CardAsset>& out,
+                              double scale = 1.0) {
+    const size_t first = out.size();
+    struct stat st;
+    if ((kinds & CARD_ASSET_GLOBAL) && stat(ctx->global.c_str(), &st) == 0)
+        out.push_back(CardAsset{CARD_ASSET_GLOBAL, ctx->global, 100, 100, ""});
+    if (kinds & CARD_ASSET_SKIN) {
+        for (const auto& skin : ListDir(ctx->skin, true)) {
+            const std::string dir = ctx->skin + skin + "/";
+            for (const auto& file : ListDir(dir, false)) {
+                if (!file.compare(0, 8, "ranking-"))
+                    out.push_back(CardAsset{CARD_ASSET_SKIN, dir + file, 82, 98, skin});
+                else if (!file.compare(0, 5, "mode-"))
+                    out.push_back(CardAsset{CARD_ASSET_SKIN, dir + file, 80, 80, skin});
+            }
+        }
+    }
+    const struct {
+        int kind;
+        const std::string* dir;
+        const char* prefix;
+        std::vector<std::pair<size_t, size_t>> sizes;
+    } dirs[] = {
+        {CARD_ASSET_COUNTRY, &ctx->country, "", {{80, 80}}},
+        {CARD_ASSET_EDGE, &ctx->edge, "", {{970, 600}, {820, 140}, {825, 150}}},
+        {CARD_ASSET_OPACITY, &ctx->opacity, "fx", {{0, 0}}},
+        {CARD_ASSET_AVATAR, &ctx->avatar, "", {{350, 350}}},
+        {CARD_ASSET_BACKGROUND, &ctx->background, "", {{0, 0}}},
+    };
+    for (const auto& d : dirs) {
+        if (!(kinds & d.kind)) continue;
+        for (const auto& file : ListDir(*d.dir, false)) {
+            const std::string format = Sayobot::Image::FormatFromPath(file);
+            if (file.compare(0, strlen(d.prefix), d.prefix)
+                || (format != "PNG" && format != "JPEG" && format != "WEBP"))
+                continue;
+            for (const auto& size : d.sizes)
+                out.push_back(CardAsset{d.kind, *d.dir + file, size.first, size.second, file});
+        }
+    }
+    if (scale == 1.0) return;
+    for (size_t i = first; i < out.size(); ++i) {
+        try {
+            Sayobot::Image::ScaleGeometry(ctx->assets, out[i].path, out[i].width, out[i].height,
+                                          scale);
+        } catch (Magick::Exception&) {
+        }
+    }
+}
+
+/*
+ * 渲染卡片并交给 output(Sayobot::Image&) 保存或编码，可在多个线程中同时调用
+ * DrawCard 只录制绘制命令，执行录制的命令（合成、文字）和编码都在 output 调用的 Save 中，
+ * 所以线程预算的深度和 render 的耗时都覆盖到 output 返回为止；同时记录渲染的次数
+ */
+static void RenderCard(Sayobot_Context* ctx, const UserPanelData* data, double scale,
+                       const std::function<void(Sayobot::Image&)>& output) {
+    Sayobot::Metrics& metrics = Sayobot::Metrics::Global();
+    Sayobot::ThreadBudget::Scope budget;
+    try {
+        Sayobot::MetricTimer timer(metrics.render);
+        Sayobot::Image image = DrawCard(ctx, data, scale);
+        output(image);
+        ++metrics.cards_rendered;
+    } catch (...) {
+        ++metrics.cards_failed;
+        throw;
+    }
+}
+
+// 输出缓存的键：HashPanelData + 格式 + 编码参数 + 缩放比例（不含页脚时间）
+static uint64_t OutputKey(const Sayobot_Context* ctx, const UserPanelData* data,
+                          const std::string& magick, const Sayobot::EncodeOptions& options,
+                          double scale) {
+    Sayobot::Hasher hasher;
+    HashPanelData(hasher, ctx, data);
+    hasher.Add(magick);
+    hasher.Add(options.profile);
+    hasher.Add(options.quality);
+    hasher.Add(scale);
+    return hasher.Digest();
+}
+
+/*
+ * 渲染并编码卡片，经由上下文的输出缓存（键见 OutputKey）：
+ * TTL 内的相同请求不再渲染，同时进行的相同请求只渲染一次
+ */
+static Magick::Blob EncodeCard(Sayobot_Context* ctx, const UserPanelData* data,
+                               const std::string& magick, const Sayobot::EncodeOptions& options,
+                               double scale) {
+    return ctx->outputs.Get(OutputKey(ctx, data, magick, options, scale), [&] {
+        Magick::Blob blob;
+        RenderCard(ctx, data, scale, [&](Sayobot::Image& image) {
+            image.Save(blob, magick, options);
+        });
+        return blob;
+    });
+}
+
+// 渲染卡片并保存到文件，格式由后缀名决定；没有后缀名时交给 Magick 判断，不经过输出缓存
+static void SaveCard(Sayobot_Context* ctx, const UserPanelData* data, const char* out_path,
+                     double scale) {
+    const std::string format = Sayobot::Image::FormatFromPath(out_path);
+    if (format.empty()) {
+        RenderCard(ctx, data, scale, [&](Sayobot::Image& image) {
+            image.Save(out_path, ctx->encode);
+        });
+        return;
+    }
+    Magick::Blob blob = EncodeCard(ctx, data, format, ctx->encode, scale);
+    std::ofstream file(out_path, std::ios::binary | std::ios::trunc);
+    file.write((const char*)blob.data(), blob.length());
+    if (!file.flush())
+        throw Magick::ErrorBlob(std::string("unable to write ") + out_path);
+}
+
+// 导出函数：制作卡片，输出路径必须要带有后缀名和路径（之前默认输出到data/image下）
+// 返回的字符串属于上下文，在下一次调用前有效
+SAYOBOT_API const char* Sayobot_CtxMakePersonalCard(Sayobot_Context* ctx, const UserPanelData* data, const char* out_path) {
+    SaveCard(ctx, data, out_path, ctx->scale.load());
+
+    ctx->result = "[CQ:image, file=file://";
+    ctx->result += out_path;
+    ctx->result += "]";
+    return ctx->result.c_str();
+}
+
+// 导出函数：使用默认上下文制作卡片
+SAYOBOT_API const char* MakePersonalCard(const UserPanelData* data, const char* out_path) {
+    return Sayobot_CtxMakePersonalCard(DefaultContext(), data, out_path);
+}
+
+// 批量接口的返回状态
+enum Sayobot_Status {
+    SAYOBOT_OK = 0,
+    SAYOBOT_EINVAL = -1,    // 参数错误
+    SAYOBOT_EMAGICK = -2,   // Magick++ 读取/绘制/保存失败
+    SAYOBOT_EUNKNOWN = -3,
+    SAYOBOT_EBUSY = -4,     // 异步队列已满，稍后重试
+    SAYOBOT_ENOTFOUND = -5, // 查找的数据不存在
+    SAYOBOT_EIO = -6,       // 读写文件失败
+    SAYOBOT_PENDING = 1     // 异步任务尚未完成
+};
+
+/*
+ * 导出函数：批量制作卡片
+ * 参数列表:
+ *** ctx (Sayobot_Context*) 渲染上下文，各线程共享其素材缓存和底层缓存
+ *** items (const UserPanelData*) n 个卡片数据
+ *** out_paths (const char* const*) n 个输出路径
+ *** threads (int) 线程数，小于等于0时使用CPU核数
+ *** status (int*) 可为NULL，写入每张卡片的 Sayobot_Status
+ * 返回成功的数量
+ */
+SAYOBOT_API size_t Sayobot_CtxMakePersonalCards(Sayobot_Context* ctx, const UserPanelData* items, size_t n,
+                                     const char* const* out_paths, int threads,
+                                     int* status) {
+    if (!items || !out_paths) return 0;
+    std::atomic<size_t> succeeded(0);
+    const double scale = ctx->scale.load(); // 同一批卡片使用同一比例
+    {
+        size_t workers = threads > 0 ? (size_t)threads : Sayobot::ThreadPool::DefaultThreads();
+        if (workers > n) workers = n;
+        Sayobot::ThreadPool pool(workers ? workers : 1);
+        for (size_t i = 0; i < n; ++i) {
+            pool.Submit([&, i] {
+                int code = SAYOBOT_OK;
+                try {
+                    if (!out_paths[i]) code = SAYOBOT_EINVAL;
+                    else SaveCard(ctx, items + i, out_paths[i], scale);
+                } catch (Magick::Exception&) {
+                    code = SAYOBOT_EMAGICK;
+                } catch (...) {
+                    code = SAYOBOT_EUNKNOWN;
+                }
+                if (code == SAYOBOT_OK) ++succeeded;
+                if (status) status[i] = code;
+            });
+        }
+        pool.Wait();
+    }
+    return succeeded;
+}
+
+// 导出函数：使用默认上下文批量制作卡片
+SAYOBOT_API size_t MakePersonalCards(const UserPanelData* items, size_t n,
+                                     const char* const* out_paths, int threads,
+                                     int* status) {
+    return Sayobot_CtxMakePersonalCards(DefaultContext(), items, n, out_paths, threads, status);
+}
+
+/*
+ * 解析编码描述："<格式>[:<档位>][:<质量>]"，例如 png、png:fast、jpeg:85、webp:fast:75
+ * 格式为 png/jpeg/jpg/webp（不区分大小写），未指定的部分使用上下文的默认值
+ * 不支持的格式或参数返回false
+ */
+static bool ParseEncodeSpec(const Sayobot_Context* ctx, const char* spec,
+                            std::string& magick, Sayobot::EncodeOptions& options) {
+    if (!spec) return false;
+    options = ctx->encode;
+    std::stringstream ss(spec);
+    std::string part;
+    std::getline(ss, part, ':');
+    if (!strcasecmp(part.c_str(), "png")) magick = "PNG";
+    else if (!strcasecmp(part.c_str(), "jpeg") || !strcasecmp(part.c_str(), "jpg")) magick = "JPEG";
+    else if (!strcasecmp(part.c_str(), "webp")) magick = "WEBP";
+    else return false;
+    while (std::getline(ss, part, ':')) {
+        if (Sayobot::EncodeOptions::ParseProfile(part, options.profile)) continue;
+        char* end;
+        long quality = strtol(part.c_str(), &end, 10);
+        if (part.empty() || *end || quality < 0 || quality > 100) return false;
+        options.quality = (int)quality;
+    }
+    return true;
+}
+
+/*
+ * 导出函数：制作卡片并编码到内存，不经过文件
+ * 参数列表:
+ *** ctx (Sayobot_Context*) 渲染上下文
+ *** data (const UserPanelData*) 卡片数据
+ *** format (const char*) 编码描述，见 ParseEncodeSpec，如 png、png:fast、webp:80
+ *** out_data (unsigned char**) 输出的编码数据，使用 Sayobot_FreeBuffer 释放
+ *** out_len (size_t*) 输出数据的长度
+ * 返回 Sayobot_Status，失败时 *out_data 为NULL
+ */
+SAYOBOT_API int Sayobot_CtxMakePersonalCardToMemory(Sayobot_Context* ctx, const UserPanelData* data,
+                                                    const char* format, unsigned char** out_data,
+                                                    size_t* out_len) {
+    if (!out_data || !out_len) return SAYOBOT_EINVAL;
+    *out_data = NULL;
+    *out_len = 0;
+    std::string magick;
+    Sayobot::EncodeOptions options;
+    if (!data || !ParseEncodeSpec(ctx, format, magick, options)) return SAYOBOT_EINVAL;
+    Magick::Blob blob;
+    try {
+        blob = EncodeCard(ctx, data, magick, options, ctx->scale.load());
+    } catch (Magick::Exception&) {
+        return SAYOBOT_EMAGICK;
+    } catch (...) {
+        return SAYOBOT_EUNKNOWN;
+    }
+    unsigned char* buf = (unsigned char*)malloc(blob.length() ? blob.length() : 1);
+    if (!buf) return SAYOBOT_EUNKNOWN;
+    memcpy(buf, blob.data(), blob.length());
+    *out_data = buf;
+    *out_len = blob.length();
+    return SAYOBOT_OK;
+}
+
+// 导出函数：使用默认上下文制作卡片并编码到内存
+SAYOBOT_API int Sayobot_MakePersonalCardToMemory(const UserPanelData* data, const char* format,
+                                                 unsigned char** out_data, size_t* out_len) {
+    return Sayobot_CtxMakePersonalCardToMemory(DefaultContext(), data, format, out_data, out_len);
+}
+
+// 导出函数：释放 Sayobot_*ToMemory 返回的数据
+SAYOBOT_API void Sayobot_FreeBuffer(unsigned char* buf) {
+    free(buf);
+}
+
+/*
+ * 异步任务完成时的回调，在库的工作线程中调用
+ * 结果要在回调中用 Sayobot_Poll 取回，回调返回后任务即被释放（任务号随之失效）
+ */
+typedef void (*Sayobot_Callback)(uint64_t job_id, int status, void* user);
+
+// 异步渲染的参数
+struct Sayobot_SubmitOptions {
+    const char* out_path;      // 不为NULL时保存到文件，格式由后缀名决定
+    const char* format;        // out_path 为NULL时编码到内存，编码描述见 ParseEncodeSpec，NULL为png
+    Sayobot_Callback callback; // 可为NULL，见 Sayobot_Callback
+    void* user;                // 原样传给 callback
+};
+
+// 异步渲染任务，status 由 AsyncJobs::mutex 保护
+struct AsyncJob {
+    explicit AsyncJob(const UserPanelData& data) : panel(data) {}
+
+    PanelDataCopy panel;
+    std::string out_path, magick;
+    Sayobot::EncodeOptions options;
+    double scale = 1.0; // 提交时上下文的缩放比例
+    Sayobot_Callback callback = NULL;
+    void* user = NULL;
+    int status = SAYOBOT_PENDING;
+    Magick::Blob blob;
+};
+
+// 进程内所有未取回的异步任务，Sayobot_Poll 只凭任务号就能找到
+struct AsyncJobs {
+    std::mutex mutex;
+    uint64_t next_id = 1;
+    std::unordered_map<uint64_t, std::shared_ptr<AsyncJob>> jobs;
+
+    static AsyncJobs& Global() {
+        static AsyncJobs instance;
+        return instance;
+    }
+};
+
+/*
+ * 导出函数：提交异步渲染任务，立即返回
+ * 参数列表:
+ *** ctx (Sayobot_Context*) 渲染上下文，为NULL时使用默认上下文
+ *** data (const UserPanelData*) 卡片数据，提交时深拷贝，调用返回后即可释放
+ *** options (const Sayobot_SubmitOptions*) 可为NULL，即编码为png到内存
+ * 返回任务号（大于0）；参数错误返回 SAYOBOT_EINVAL，队列已满返回 SAYOBOT_EBUSY
+ */
+SAYOBOT_API int64_t Sayobot_Submit(Sayobot_Context* ctx, const UserPanelData* data,
+                                   const Sayobot_SubmitOptions* options) {
+    if (!ctx) ctx = DefaultContext();
+    if (!data) return SAYOBOT_EINVAL;
+    std::shared_ptr<AsyncJob> job = std::make_shared<AsyncJob>(*data);
+    job->scale = ctx->scale.load();
+    if (options && options->out_path) {
+        job->out_path = options->out_path;
+    } else if (!ParseEncodeSpec(ctx, options && options->format ? options->format : "png",
+                                job->magick, job->options)) {
+        return SAYOBOT_EINVAL;
+    }
+    if (options) {
+        job->callback = options->callback;
+        job->user = options->user;
+    }
+
+    AsyncJobs& table = AsyncJobs::Global();
+    uint64_t id;
+    {
+        std::lock_guard<std::mutex> lock(table.mutex);
+        id = table.next_id++;
+        table.jobs[id] = job;
+    }
+    // 排队的任务也计入线程预算的深度，开始执行时移出（之后由 RenderCard 计入）
+    Sayobot::ThreadBudget& budget = Sayobot::ThreadBudget::Global();
+    budget.Add(0, 1);
+    bool queued = ctx->queue.TrySubmit([ctx, job, id] {
+        Sayobot::ThreadBudget::Global().Add(0, -1);
+        int code = SAYOBOT_OK;
+        Magick::Blob blob;
+        try {
+            if (!job->out_path.empty())
+                SaveCard(ctx, &job->panel.data, job->out_path.c_str(), job->scale);
+            else blob = EncodeCard(ctx, &job->panel.data, job->magick, job->options, job->scale);
+        } catch (Magick::Exception&) {
+            code = SAYOBOT_EMAGICK;
+        } catch (...) {
+            code = SAYOBOT_EUNKNOWN;
+        }
+        {
+            AsyncJobs& table = AsyncJobs::Global();
+            std::lock_guard<std::mutex> lock(table.mutex);
+            job->blob = blob;
+            job->status = code;
+        }
+        if (job->callback) {
+            job->callback(id, code, job->user);
+            // 回调中没有取回的结果不再保留，否则只用回调的调用方会一直占着这些内存
+            AsyncJobs& table = AsyncJobs::Global();
+            std::lock_guard<std::mutex> lock(table.mutex);
+            table.jobs.erase(id);
+        }
+    });
+    if (!queued) {
+        budget.Add(0, -1);
+        std::lock_guard<std::mutex> lock(table.mutex);
+        table.jobs.erase(id);
+        return SAYOBOT_EBUSY;
+    }
+    return (int64_t)id;
+}
+
+/*
+ * 导出函数：查询异步任务
+ * 未完成时返回 SAYOBOT_PENDING；完成后返回任务的 Sayobot_Status 并释放任务（任务号随之失效），
+ * 编码到内存的任务在成功时写入 *out_data 和 *out_len（用 Sayobot_FreeBuffer 释放），
+ * out_data 为NULL时丢弃结果；未知的任务号返回 SAYOBOT_EINVAL
+ */
+SAYOBOT_API int Sayobot_Poll(uint64_t job_id, unsigned char** out_data, size_t* out_len) {
+    if (out_data) *out_data = NULL;
+    if (out_len) *out_len = 0;
+    std::shared_ptr<AsyncJob> job;
+    {
+        AsyncJobs& table = AsyncJobs::Global();
+        std::lock_guard<std::mutex> lock(table.mutex);
+        auto it = table.jobs.find(job_id);
+        if (it == table.jobs.end()) return SAYOBOT_EINVAL;
+        if (it->second->status == SAYOBOT_PENDING) return SAYOBOT_PENDING;
+        job = it->second;
+        table.jobs.erase(it);
+    }
+    if (job->status != SAYOBOT_OK || !job->out_path.empty() || !out_data) return job->status;
+    unsigned char* buf = (unsigned char*)malloc(job->blob.length() ? job->blob.length() : 1);
+    if (!buf) return SAYOBOT_EUNKNOWN;
+    memcpy(buf, job->blob.data(), job->blob.length());
+    *out_data = buf;
+    if (out_len) *out_len = job->blob.length();
+    return SAYOBOT_OK;
+}
+
+/*
+ * 导出函数：设置上下文异步队列的线程数和容量，小于0的参数保持不变，threads为0时使用CPU核数
+ * 返回排队中（尚未开始渲染）的任务数
+ */
+SAYOBOT_API int64_t Sayobot_CtxSetQueue(Sayobot_Context* ctx, int threads, int capacity) {
+    ctx->queue.Configure(threads >= 0 ? (size_t)threads : ctx->queue.Threads(),
+                         capacity >= 0 ? (size_t)capacity : ctx->queue.Capacity());
+    return (int64_t)ctx->queue.Pending();
+}
+
+// 线程预算的策略，见 Sayobot::ThreadBudget
+enum Sayobot_ThreadPolicy {
+    SAYOBOT_THREADS_AUTO = 0,   // 按深度在“一张卡片用满所有核”和“每张卡片一个线程”之间调整
+    SAYOBOT_THREADS_WIDE = 1,   // 一张卡片用满所有核
+    SAYOBOT_THREADS_NARROW = 2, // 每张卡片一个线程
+    SAYOBOT_THREADS_OFF = 3     // 不修改 Magick 的限制
+};
+
+// 线程预算的当前状态，magick_* 为 Magick 实际生效的限制
+struct Sayobot_ThreadReport {
+    int policy;             // Sayobot_ThreadPolicy
+    uint32_t cores;         // 预算的核数
+    uint32_t active;        // 正在渲染的卡片数
+    uint32_t queued;        // 异步队列中排队的任务数
+    uint64_t memory;        // 配置的内存预算，0为不管理
+    uint64_t magick_threads;
+    uint64_t magick_memory;
+    uint64_t magick_area;
+};
+
+/*
+ * 导出函数：设置进程内的线程预算，所有上下文共用，小于0的参数保持不变
+ * 参数列表:
+ *** policy (int) Sayobot_ThreadPolicy，默认为 SAYOBOT_THREADS_AUTO
+ *** cores (int) 可使用的核数，为0时使用CPU核数
+ *** memory (int64_t) Magick 像素缓存的内存预算（字节），为0时不管理内存和 area
+ * 返回 Sayobot_Status
+ */
+SAYOBOT_API int Sayobot_SetThreadPolicy(int policy, int cores, int64_t memory) {
+    if (policy > SAYOBOT_THREADS_OFF) return SAYOBOT_EINVAL;
+    Sayobot::ThreadBudget& budget = Sayobot::ThreadBudget::Global();
+    const Sayobot::ThreadBudget::State state = budget.Get();
+    budget.Configure(policy >= 0 ? (Sayobot::ThreadBudget::Policy)policy : state.policy,
+                     cores >= 0 ? (size_t)cores : state.cores,
+                     memory >= 0 ? (uint64_t)memory : state.memory);
+    return SAYOBOT_OK;
+}
+
+// 导出函数：读取线程预算的当前状态
+SAYOBOT_API void Sayobot_GetThreadPolicy(Sayobot_ThreadReport* out) {
+    const Sayobot::ThreadBudget::State state = Sayobot::ThreadBudget::Global().Get();
+    out->policy = state.policy;
+    out->cores = (uint32_t)state.cores;
+    out->active = (uint32_t)state.active;
+    out->queued = (uint32_t)state.queued;
+    out->memory = state.memory;
+    out->magick_threads = Magick::ResourceLimits::thread();
+    out->magick_memory = Magick::ResourceLimits::memory();
+    out->magick_area = Magick::ResourceLimits::area();
+}
+
+/*
+ * 导出函数：把 UserPanelData 写成扁平形式（见 Sayobot_FlatPanel），返回需要的字节数
+ * buf 为NULL或 cap 不够时只返回大小
+ */
+SAYOBOT_API size_t Sayobot_FlattenPanel(const UserPanelData* data, void* buf, size_t cap) {
+    return data ? FlattenPanelData(*data, buf, cap) : 0;
+}
+
+/*
+ * 导出函数：用扁平形式的数据制作卡片，与 Sayobot_CtxMakePersonalCard 相同
+ * 数据不合法时返回NULL
+ */
+SAYOBOT_API const char* Sayobot_CtxMakePersonalCardFlat(Sayobot_Context* ctx, const void* buf, size_t len,
+                                                        const char* out_path) {
+    UserPanelData data;
+    if (!PanelDataView(buf, len, data)) return NULL;
+    return Sayobot_CtxMakePersonalCard(ctx, &data, out_path);
+}
+
+// 导出函数：使用默认上下文和扁平形式的数据制作卡片
+SAYOBOT_API const char* MakePersonalCardFlat(const void* buf, size_t len, const char* out_path) {
+    return Sayobot_CtxMakePersonalCardFlat(DefaultContext(), buf, len, out_path);
+}
+
+/*
+ * 导出函数：批量制作卡片，buf 中为 n 个首尾相连的扁平数据（各自补齐到8字节）
+ * 其余参数和返回值与 Sayobot_CtxMakePersonalCards 相同；数据不合法时返回0，status 全部为 SAYOBOT_EINVAL
+ */
+SAYOBOT_API size_t Sayobot_CtxMakePersonalCardsFlat(Sayobot_Context* ctx, const void* buf, size_t len,
+                                                    size_t n, const char* const* out_paths,
+                                                    int threads, int* status) {
+    std::vector<UserPanelData> items(n);
+    size_t offset = 0;
+    for (size_t i = 0; i < n; ++i) {
+        size_t size;
+        if (offset > len || !PanelDataView((const char*)buf + offset, len - offset, items[i], &size)) {
+            if (status) std::fill(status, status + n, (int)SAYOBOT_EINVAL);
+            return 0;
+        }
+        offset += (size + 7) & ~(size_t)7;
+    }
+    return Sayobot_CtxMakePersonalCards(ctx, items.data(), n, out_paths, threads, status);
+}
+
+// 导出函数：用扁平形式的数据制作卡片并编码到内存，与 Sayobot_CtxMakePersonalCardToMemory 相同
+SAYOBOT_API int Sayobot_CtxMakePersonalCardFlatToMemory(Sayobot_Context* ctx, const void* buf, size_t len,
+                                                        const char* format, unsigned char** out_data,
+                                                        size_t* out_len) {
+    UserPanelData data;
+    if (!PanelDataView(buf, len, data)) {
+        if (out_data) *out_data = NULL;
+        if (out_len) *out_len = 0;
+        return SAYOBOT_EINVAL;
+    }
+    return Sayobot_CtxMakePersonalCardToMemory(ctx, &data, format, out_data, out_len);
+}
+
+/*
+ * 导出函数：用扁平形式的数据提交异步渲染，与 Sayobot_Submit 相同
+ * 字符串在返回前复制（异步任务在返回之后才进行），调用后即可释放 buf
+ */
+SAYOBOT_API int64_t Sayobot_SubmitFlat(Sayobot_Context* ctx, const void* buf, size_t len,
+                                       const Sayobot_SubmitOptions* options) {
+    UserPanelData data;
+    if (!PanelDataView(buf, len, data)) return SAYOBOT_EINVAL;
+    return Sayobot_Submit(ctx, &data, options);
+}
+
+// Sayobot_Preload 的 flags
+enum Sayobot_PreloadFlags {
+    SAYOBOT_PRELOAD_ASSETS = 1,  // 解码背景、框框、皮肤、国旗等素材（按素材缓存的预算，装满为止）
+    SAYOBOT_PRELOAD_AVATARS = 2, // 连同头像一起解码
+    SAYOBOT_PRELOAD_FONTS = 4,   // 加载 font_set 中的所有字体
+    SAYOBOT_PRELOAD_WARMUP = 8   // 用找到的素材渲染并编码一张假的卡片
+};
+
+// 预加载的进度回调，在调用 Sayobot_Preload 的线程中调用
+typedef void (*Sayobot_PreloadProgress)(size_t done, size_t total, void* user);
+
+// 预加载的结果
+struct Sayobot_PreloadReport {
+    uint64_t assets;         // 解码（或在素材包中找到）的素材数
+    uint64_t assets_failed;  // 无法解码的素材数
+    uint64_t assets_skipped; // 素材缓存已满而跳过的素材数
+    uint64_t fonts;          // 成功加载的字体数
+    int warmup_status;       // 假卡片的 Sayobot_Status，未要求时为 SAYOBOT_OK
+    uint64_t elapsed_us;     // 总耗时（微秒）
+};
+
+/*
+ * 导出函数：预加载素材和字体，并可渲染一张假的卡片，使重启后最初的几张卡片与稳定时一样快
+ * 参数列表:
+ *** ctx (Sayobot_Context*) 渲染上下文，为NULL时使用默认上下文
+ *** flags (int) Sayobot_PreloadFlags 的组合
+ *** threads (int) 解码的线程数，小于等于0时使用CPU核数
+ *** progress (Sayobot_PreloadProgress) 可为NULL，解码素材时大约每100毫秒调用一次
+ *** user (void*) 原样传给 progress
+ *** report (Sayobot_PreloadReport*) 可为NULL
+ * 返回 Sayobot_Status，素材解码失败不算失败（见 report）
+ */
+SAYOBOT_API int Sayobot_Preload(Sayobot_Context* ctx, int flags, int threads,
+                                Sayobot_PreloadProgress progress, void* user,
+                                Sayobot_PreloadReport* report) {
+    if (!ctx) ctx = DefaultContext();
+    const auto start = std::chrono::steady_clock::now();
+    Sayobot_PreloadReport result = Sayobot_PreloadReport();
+
+    std::vector<CardAsset> assets;
+    int kinds = 0;
+    if (flags & (SAYOBOT_PRELOAD_ASSETS | SAYOBOT_PRELOAD_WARMUP))
+        kinds = CARD_ASSET_GLOBAL | CARD_ASSET_SKIN | CARD_ASSET_COUNTRY | CARD_ASSET_EDGE
+                | CARD_ASSET_OPACITY | CARD_ASSET_BACKGROUND;
+    if (flags & SAYOBOT_PRELOAD_AVATARS) kinds |= CARD_ASSET_AVATAR;
+    const double scale = ctx->scale.load();
+    CollectCardAssets(ctx, kinds, assets, scale);
+
+    if (flags & (SAYOBOT_PRELOAD_ASSETS | SAYOBOT_PRELOAD_AVATARS)) {
+        std::atomic<size_t> done(0), loaded(0), failed(0), skipped(0);
+        Sayobot::ThreadPool pool(threads > 0 ? (size_t)threads : 0);
+        for (const CardAsset& asset : assets) {
+            if (asset.kind != CARD_ASSET_AVATAR && !(flags & SAYOBOT_PRELOAD_ASSETS)) {
+                ++done;
+                continue;
+            }
+            pool.Submit([&, asset] {
+                if (ctx->assets.Used() >= ctx->assets.Capacity()) {
+                    ++skipped;
+                } else {
+                    try {
+                        ctx->assets.LoadRaster(asset.path, asset.width, asset.height);
+                        ++loaded;
+                    } catch (...) {
+                        ++failed;
+                    }
+                }
+                ++done;
+            });
+        }
+        while (done < assets.size()) {
+            if (progress) progress(done, assets.size(), user);
+            std::this_thread::sleep_for(std::chrono::milliseconds(100));
+        }
+        pool.Wait();
+        if (progress) progress(done, assets.size(), user);
+        result.assets = loaded;
+        result.assets_failed = failed;
+        result.assets_skipped = skipped;
+    }
+
+    if (flags & SAYOBOT_PRELOAD_FONTS) {
+        for (const std::string* font : {&ctx->font_set.profile, &ctx->font_set.data,
+                                        &ctx->font_set.sign, &ctx->font_set.time,
+                                        &ctx->font_set.arrow, &ctx->font_set.name})
+            result.fonts += ctx->glyphs.LoadFace(ctx->font + *font);
+    }
+
+    if (flags & SAYOBOT_PRELOAD_WARMUP) {
+        // 配置取找到的第一个背景、框框、皮肤和国旗
+        std::string background, edge, skin, country;
+        for (const CardAsset& asset : assets) {
+            if (asset.kind == CARD_ASSET_BACKGROUND && background.empty()) background = asset.name;
+            else if (asset.kind == CARD_ASSET_EDGE && edge.empty()) edge = asset.name;
+            else if (asset.kind == CARD_ASSET_SKIN && skin.empty()) skin = asset.name;
+            else if (asset.kind == CARD_ASSET_COUNTRY && country.empty())
+                country = asset.name.substr(0, asset.name.find('.'));
+        }
+        if (country.empty()) country = "__";
+        std::string username = "warmup", sign = "Sayobot", color = "#FFFFFF";
+        UserPanelData data = UserPanelData();
+        data.mode = _std;
+        data.uinfo.username = &username[0];
+        data.uinfo.country = &country[0];
+        data.uinfo.global_rank = 1;
+        data.uinfo.pp = 1.0f;
+        data.uinfo.accuracy = 100.0;
+        data.config.opacity = 0;
+        data.config.sign = &sign[0];
+        data.config.background = &background[0];
+        data.config.edge.profile = data.config.edge.data = data.config.edge.sign = &edge[0];
+        data.config.color.profile = data.config.color.data = data.config.color.sign =
+            data.config.color.time = data.config.color.arrowup = data.config.color.arrowdown =
+                data.config.color.name = &color[0];
+        data.config.skin = &skin[0];
+        data.stat = UserStatData();
+        data.stat.user_id = -1;
+        data.compareDays = 0;
+        try {
+            Magick::Blob blob;
+            RenderCard(ctx, &data, scale, [&](Sayobot::Image& image) {
+                image.Save(blob, "PNG", ctx->encode);
+            });
+            result.warmup_status = SAYOBOT_OK;
+        } catch (Magick::Exception&) {
+            result.warmup_status = SAYOBOT_EMAGICK;
+        } catch (...) {
+            result.warmup_status = SAYOBOT_EUNKNOWN;
+        }
+    }
+
+    result.elapsed_us = std::chrono::duration_cast<std::chrono::microseconds>(
+                            std::chrono::steady_clock::now() - start)
+                            .count();
+    if (report) *report = result;
+    return SAYOBOT_OK;
+}
+
+/*
+ * 导出函数：为上下文打开头像库，不存在时创建；之后卡片上的头像优先从库中取得
+ * path 为NULL时关闭；返回库中的用户数，文件无法打开或格式不对时返回 -1
+ */
+SAYOBOT_API int64_t Sayobot_CtxOpenAvatars(Sayobot_Context* ctx, const char* path) {
+    if (!path) {
+        std::atomic_store(&ctx->avatars, std::shared_ptr<Sayobot::AvatarStore>());
+        return 0;
+    }
+    std::shared_ptr<Sayobot::AvatarStore> avatars = Sayobot::AvatarStore::Open(path);
+    if (!avatars) return -1;
+    std::atomic_store(&ctx->avatars, avatars);
+    return (int64_t)avatars->Size();
+}
+
+/*
+ * 导出函数：把头像图片解码、缩放后存入头像库（替换旧的头像），path 为NULL时删除该用户的头像
+ * 例如 osu.updateGravatar 下载新头像后调用
+ * 被替换的头像超过库的一半且多于64MB时顺便压缩
+ * 返回 Sayobot_Status：没有打开头像库时为 SAYOBOT_EINVAL，写入失败时为 SAYOBOT_EIO
+ */
+SAYOBOT_API int Sayobot_CtxPutAvatar(Sayobot_Context* ctx, int64_t user_id, const char* path) {
+    std::shared_ptr<Sayobot::AvatarStore> avatars = std::atomic_load(&ctx->avatars);
+    if (!avatars) return SAYOBOT_EINVAL;
+    try {
+        if (!(path ? avatars->Put(user_id, std::string(path)) : avatars->Remove(user_id)))
+            return SAYOBOT_EIO;
+    } catch (Magick::Exception&) {
+        return SAYOBOT_EMAGICK;
+    }
+    const uint64_t garbage = avatars->Garbage();
+    if (garbage > ((uint64_t)64 << 20) && garbage * 2 > avatars->Bytes()) avatars->Compact();
+    return SAYOBOT_OK;
+}
+
+// 导出函数：压缩头像库，返回回收的字节数，没有打开头像库或失败时返回 -1
+SAYOBOT_API int64_t Sayobot_CtxCompactAvatars(Sayobot_Context* ctx) {
+    std::shared_ptr<Sayobot::AvatarStore> avatars = std::atomic_load(&ctx->avatars);
+    return avatars ? avatars->Compact() : -1;
+}
+
+// 用户数据快照库：每个模式一个 Sayobot::StatStore
+struct Sayobot_StatStore {
+    std::shared_ptr<Sayobot::StatStore> modes[4];
+};
+
+static Sayobot::StatSnapshot ToSnapshot(const UserStatData& src) {
+    Sayobot::StatSnapshot snapshot;
+    snapshot.user_id = src.user_id;
+    snapshot.qq = src.qq;
+    snapshot.username = src.username ? src.username : "";
+    snapshot.country = src.country ? src.country : "";
+    int64_t* v = snapshot.values;
+    v[Sayobot::STAT_TIMESTAMP] = (int64_t)src.update_timestamp;
+    v[Sayobot::STAT_TOTAL_SCORE] = src.total_score;
+    v[Sayobot::STAT_RANKED_SCORE] = src.ranked_score;
+    v[Sayobot::STAT_TOTAL_HIT] = src.total_hit;
+    memcpy(&v[Sayobot::STAT_ACCURACY], &src.accuracy, sizeof(double));
+    uint32_t bits;
+    memcpy(&bits, &src.pp, sizeof(float));
+    v[Sayobot::STAT_PP] = bits;
+    memcpy(&bits, &src.level, sizeof(float));
+    v[Sayobot::STAT_LEVEL] = bits;
+    v[Sayobot::STAT_GLOBAL_RANK] = src.global_rank;
+    v[Sayobot::STAT_COUNTRY_RANK] = src.country_rank;
+    v[Sayobot::STAT_PLAYCOUNT] = src.playcount;
+    v[Sayobot::STAT_XH] = src.xh;
+    v[Sayobot::STAT_X] = src.x;
+    v[Sayobot::STAT_SH] = src.sh;
+    v[Sayobot::STAT_S] = src.s;
+    v[Sayobot::STAT_A] = src.a;
+    v[Sayobot::STAT_DAYS] = src.days;
+    return snapshot;
+}
+
+static char* CopyString(const std::string& str) {
+    char* copy = new char[str.size() + 1];
+    memcpy(copy, str.c_str(), str.size() + 1);
+    return copy;
+}
+
+static void FromSnapshot(const Sayobot::StatSnapshot& snapshot, mode_enum mode, UserStatData& dst) {
+    const int64_t* v = snapshot.values;
+    dst.user_id = snapshot.user_id;
+    dst.qq = snapshot.qq;
+    dst.username = CopyString(snapshot.username);
+    dst.country = CopyString(snapshot.country);
+    dst.update_timestamp = (time_t)v[Sayobot::STAT_TIMESTAMP];
+    dst.total_score = v[Sayobot::STAT_TOTAL_SCORE];
+    dst.ranked_score = v[Sayobot::STAT_RANKED_SCORE];
+    dst.total_hit = (int32_t)v[Sayobot::STAT_TOTAL_HIT];
+    memcpy(&dst.accuracy, &v[Sayobot::STAT_ACCURACY], sizeof(double));
+    uint32_t bits = (uint32_t)v[Sayobot::STAT_PP];
+    memcpy(&dst.pp, &bits, sizeof(float));
+    bits = (uint32_t)v[Sayobot::STAT_LEVEL];
+    memcpy(&dst.level, &bits, sizeof(float));
+    dst.global_rank = (int32_t)v[Sayobot::STAT_GLOBAL_RANK];
+    dst.country_rank = (int32_t)v[Sayobot::STAT_COUNTRY_RANK];
+    dst.playcount = v[Sayobot::STAT_PLAYCOUNT];
+    dst.xh = (int32_t)v[Sayobot::STAT_XH];
+    dst.x = (int32_t)v[Sayobot::STAT_X];
+    dst.sh = (int32_t)v[Sayobot::STAT_SH];
+    dst.s = (int32_t)v[Sayobot::STAT_S];
+    dst.a = (int32_t)v[Sayobot::STAT_A];
+    dst.days = (unsigned)v[Sayobot::STAT_DAYS];
+    dst.mode = mode;
+}
+
+/*
+ * 导出函数：打开目录下的用户数据快照库（stat-std.sybstat 等，每个模式一个文件），不存在时创建
+ * 文件无法打开或格式不对时返回NULL
+ */
+SAYOBOT_API Sayobot_StatStore* Sayobot_StatOpen(const char* dir) {
+    static const char* names[4] = {"std", "taiko", "ctb", "mania"};
+    Sayobot_StatStore* store = new Sayobot_StatStore();
+    for (uint32_t mode = 0; mode < 4; ++mode) {
+        store->modes[mode] = Sayobot::StatStore::Open(
+            std::string(dir) + "/stat-" + names[mode] + ".sybstat", mode);
+        if (!store->modes[mode]) {
+            delete store;
+            return NULL;
+        }
+    }
+    return store;
+}
+
+SAYOBOT_API void Sayobot_StatClose(Sayobot_StatStore* store) {
+    delete store;
+}
+
+/*
+ * 导出函数：追加 n 个快照（按各自的 mode 分到对应的文件），返回 Sayobot_Status
+ * 所有模式一起写入：先检查全部快照，同一用户的快照要按 update_timestamp 追加，否则返回 SAYOBOT_EINVAL；
+ * 写入或同步失败时返回 SAYOBOT_EIO；失败时所有模式的快照都不写入
+ */
+SAYOBOT_API int Sayobot_StatAppend(Sayobot_StatStore* store, const UserStatData* items, size_t n) {
+    std::vector<Sayobot::StatSnapshot> snapshots[4];
+    for (size_t i = 0; i < n; ++i) {
+        if ((unsigned)items[i].mode >= 4) return SAYOBOT_EINVAL;
+        snapshots[items[i].mode].push_back(ToSnapshot(items[i]));
+    }
+    Sayobot::StatStore* stores[4];
+    for (int mode = 0; mode < 4; ++mode) stores[mode] = store->modes[mode].get();
+    const Sayobot::StatStore::AppendStatus result =
+        Sayobot::StatStore::AppendAll(stores, snapshots, 4);
+    if (result == Sayobot::StatStore::Unordered) return SAYOBOT_EINVAL;
+    return result == Sayobot::StatStore::Appended ? SAYOBOT_OK : SAYOBOT_EIO;
+}
+
+/*
+ * 导出函数：查找用户在 timestamp 时（含）最近的快照，填入 out（字符串由 Sayobot_StatRelease 释放）
+ * 返回 Sayobot_Status，没有不晚于 timestamp 的快照时为 SAYOBOT_ENOTFOUND
+ */
+SAYOBOT_API int Sayobot_StatFind(Sayobot_StatStore* store, int mode, int32_t user_id, int64_t timestamp,
+                                 UserStatData* out) {
+    if (mode < 0 || mode >= 4 || !out) return SAYOBOT_EINVAL;
+    Sayobot::StatSnapshot snapshot;
+    if (!store->modes[mode]->Find(user_id, timestamp, snapshot)) return SAYOBOT_ENOTFOUND;
+    FromSnapshot(snapshot, (mode_enum)mode, *out);
+    return SAYOBOT_OK;
+}
+
+// 导出函数：查找 days 天前的快照，即 compareDays 使用的对比数据
+SAYOBOT_API int Sayobot_StatFindDaysAgo(Sayobot_StatStore* store, int mode, int32_t user_id, unsigned days,
+                                        UserStatData* out) {
+    return Sayobot_StatFind(store, mode, user_id, (int64_t)time(NULL) - (int64_t)days * 86400, out);
+}
+
+// 导出函数：释放 Sayobot_StatFind 填入 stat 的字符串（以 new[] 分配，不能用 UserStatData_destroy）
+SAYOBOT_API void Sayobot_StatRelease(UserStatData* stat) {
+    if (!stat) return;
+    delete[] stat->username;
+    delete[] stat->country;
+    stat->username = stat->country = nullptr;
+}
+
+// 导出函数：合并所有模式的快照块，返回回收的字节数，失败时返回 -1
+SAYOBOT_API int64_t Sayobot_StatCompact(Sayobot_StatStore* store) {
+    int64_t reclaimed = 0;
+    for (const auto& mode : store->modes) {
+        const int64_t bytes = mode->Compact();
+        if (bytes < 0) return -1;
+        reclaimed += bytes;
+    }
+    return reclaimed;
+}
+
+#define SAYOBOT_HISTOGRAM_BUCKETS 24
+
+/*
+ * 延迟直方图（微秒）
+ * buckets[0] 为小于1微秒的次数，buckets[i] 为 [2^(i-1), 2^i) 微秒的次数，
+ * 最后一个桶还包含所有更慢的
+ */
+struct Sayobot_Histogram {
+    uint64_t count;
+    uint64_t sum_us;
+    uint64_t buckets[SAYOBOT_HISTOGRAM_BUCKETS];
+};
+
+// 运行统计，进程内所有上下文共用
+struct Sayobot_Stats {
+    uint64_t cards_rendered;
+    uint64_t cards_failed;
+    Sayobot_Histogram render;   // 渲染一张卡片（录制 + 执行录制的命令 + 编码，包含 save）
+    Sayobot_Histogram drawpic;  // DrawPic（读取素材 + 合成或录制）
+    Sayobot_Histogram drawtext; // Drawtext（排版 + 绘制或录制）
+    Sayobot_Histogram save;     // Save（执行录制的命令 + 编码）
+    uint64_t asset_hits, asset_misses;
+    uint64_t layer_hits, layer_misses;
+    uint64_t glyph_hits, glyph_misses;
+    uint64_t bytes_decoded;     // 解码后的像素字节数
+    int64_t canvas_bytes;       // 当前画布占用的内存
+    int64_t peak_canvas_bytes;  // 画布内存的峰值
+};
 
-        static string_t result;
-        result = "[CQ:image, file=file://";
-        result += out_path;
-        result += "]";
-        return result.c_str();
+static void CopyHistogram(const Sayobot::Histogram& src, Sayobot_Histogram* dst) {
+    static_assert(Sayobot::Histogram::Buckets == SAYOBOT_HISTOGRAM_BUCKETS,
+                  "histogram bucket count mismatch");
+    dst->count = src.count;
+    dst->sum_us = src.sum_us;
+    for (int i = 0; i < SAYOBOT_HISTOGRAM_BUCKETS; ++i)
+        dst->buckets[i] = src.buckets[i];
 }
 
-}
\ No newline at end of file
+// 导出函数：读取运行统计
+SAYOBOT_API void Sayobot_GetStats(Sayobot_Stats* out) {
+    const Sayobot::Metrics& metrics = Sayobot::Metrics::Global();
+    out->cards_rendered = metrics.cards_rendered;
+    out->cards_failed = metrics.cards_failed;
+    CopyHistogram(metrics.render, &out->render);
+    CopyHistogram(metrics.drawpic, &out->drawpic);
+    CopyHistogram(metrics.drawtext, &out->drawtext);
+    CopyHistogram(metrics.save, &out->save);
+    out->asset_hits = metrics.asset_hits;
+    out->asset_misses = metrics.asset_misses;
+    out->layer_hits = metrics.layer_hits;
+    out->layer_misses = metrics.layer_misses;
+    out->glyph_hits = metrics.glyph_hits;
+    out->glyph_misses = metrics.glyph_misses;
+    out->bytes_decoded = metrics.bytes_decoded;
+    out->canvas_bytes = metrics.canvas_bytes;
+    out->peak_canvas_bytes = metrics.peak_canvas_bytes;
+}
+
+// 导出函数：清零运行统计
+SAYOBOT_API void Sayobot_ResetStats() {
+    Sayobot::Metrics::Global().Reset();
+}
+
+// 导出函数：编译时使用的 Magick 像素格式，libsyb.so 为 "Q16-HDRI"，libsyb_q8.so 为 "Q8"
+SAYOBOT_API const char* Sayobot_Variant() {
+    return Sayobot::QuantumTraits::Name();
+}
+
+/*
+ * 导出函数：计算图片文件的64位感知哈希
+ * 返回 Sayobot_Status，成功时写入 *out
+ */
+SAYOBOT_API int Sayobot_PHashFile(const char* path, uint64_t* out) {
+    if (!path || !out) return SAYOBOT_EINVAL;
+    try {
+        Sayobot::Image image;
+        image.ReadFromFile(path);
+        *out = image.GetBinaryHash().bits;
+    } catch (Magick::Exception&) {
+        return SAYOBOT_EMAGICK;
+    } catch (...) {
+        return SAYOBOT_EUNKNOWN;
+    }
+    return SAYOBOT_OK;
+}
+
+// 导出函数：两个感知哈希的汉明距离 (0~64)
+SAYOBOT_API int Sayobot_PHashDistance(uint64_t a, uint64_t b) {
+    return Sayobot::PHash::Distance(Sayobot::PHash{a}, Sayobot::PHash{b});
+}
+
+struct Sayobot_PHashIndex {
+    Sayobot::PHashIndex index;
+};
+
+// 导出函数：创建感知哈希的相似度索引
+SAYOBOT_API Sayobot_PHashIndex* Sayobot_PHashIndexCreate() {
+    return new Sayobot_PHashIndex();
+}
+
+SAYOBOT_API void Sayobot_PHashIndexDestroy(Sayobot_PHashIndex* index) {
+    delete index;
+}
+
+// 导出函数：加入一个哈希，id 由调用者决定（例如图片在数据库中的编号）
+SAYOBOT_API void Sayobot_PHashIndexInsert(Sayobot_PHashIndex* index, uint64_t hash, uint64_t id) {
+    index->index.Insert(Sayobot::PHash{hash}, id);
+}
+
+SAYOBOT_API size_t Sayobot_PHashIndexSize(Sayobot_PHashIndex* index) {
+    return index->index.Size();
+}
+
+/*
+ * 导出函数：查询距离不超过 max_distance 的所有项目
+ * 参数列表:
+ *** out_ids (uint64_t*) 可为NULL，写入至多 capacity 个结果的id
+ *** out_distances (int*) 可为NULL，写入对应的距离
+ * 返回结果总数（可能大于 capacity），结果按距离从小到大排序
+ */
+SAYOBOT_API size_t Sayobot_PHashIndexQuery(Sayobot_PHashIndex* index, uint64_t hash, int max_distance,
+                                           uint64_t* out_ids, int* out_distances, size_t capacity) {
+    std::vector<std::pair<uint64_t, int>> found;
+    index->index.Query(Sayobot::PHash{hash}, max_distance, found);
+    std::sort(found.begin(), found.end(),
+              [](const std::pair<uint64_t, int>& a, const std::pair<uint64_t, int>& b) {
+                  return a.second != b.second ? a.second < b.second : a.first < b.first;
+              });
+    for (size_t i = 0; i < found.size() && i < capacity; ++i) {
+        if (out_ids) out_ids[i] = found[i].first;
+        if (out_distances) out_distances[i] = found[i].second;
+    }
+    return found.size();
+}
+
+/*
+ * 导出函数：按渲染输入生成内容寻址的卡片名（16位十六进制，不含后缀名）
+ * 相同的输入得到相同的名字，不需要渲染也不需要计算感知哈希；
+ * 上下文的缩放比例（Sayobot_CtxSetScale）也是输入的一部分，预览图与原尺寸的卡片名字不同
+ * out 至少需要17字节，返回 out；参数错误时返回NULL
+ */
+SAYOBOT_API const char* Sayobot_CtxCardName(Sayobot_Context* ctx, const UserPanelData* data,
+                                            char* out, size_t len) {
+    if (!ctx || !data || !out || len < 17) return NULL;
+    Sayobot::Hasher hasher;
+    HashPanelData(hasher, ctx, data);
+    hasher.Add(ctx->scale.load());
+    memcpy(out, hasher.HexDigest().c_str(), 17);
+    return out;
+}
+
+SAYOBOT_API const char* Sayobot_CardName(const UserPanelData* data, char* out, size_t len) {
+    return Sayobot_CtxCardName(DefaultContext(), data, out, len);
+}
+
+// 导出函数：对任意字节（例如编码后的图片）做快速的非加密64位哈希
+SAYOBOT_API uint64_t Sayobot_HashBytes(const void* data, size_t len) {
+    return Sayobot::Hasher::Hash(data, len);
+}
+
+}
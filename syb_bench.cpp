@@ -0,0 +1,383 @@
+/*
+ * libsyb 的性能测试：渲染 N 张合成的卡片，输出吞吐量以及各阶段耗时的 p50/p95/p99
+ * 用法:
+ *** syb_bench --font 字体文件 [-n 卡片数] [-t 线程数] [-f 编码描述] [--skins 皮肤数] [--cold]
+ ***           [--scale 缩放比例]
+ *** syb_bench --assets 素材根目录 [...]
+ * 不指定 --assets 时在临时目录下生成合成素材（需要用 --font 指定一个TTF字体）
+ * 素材根目录与线上的目录结构相同：png/stat、png/tk、png/rank、png/country、png/world、
+ * png/avatars、png/fx*.png 以及 fonts/
+ * --cold 在每张卡片前清空缓存，用于测量解码和缩放
+ * --scale 直接按比例渲染较小的卡片（如 0.5 为 540x960）
+ */
+#include "syb.cpp"
+
+#include <stdio.h>
+#include <unistd.h>
+
+namespace
+{
+    struct BenchOptions {
+        int cards = 200;
+        int threads = 1;
+        int skins = 3;
+        bool cold = false;
+        double scale = 1.0;
+        Sayobot::ThreadBudget::Policy policy = Sayobot::ThreadBudget::Auto;
+        std::string format = "png";
+        std::string assets;
+        std::string font;
+    };
+
+    // 一张卡片各阶段的耗时（纳秒），最后一项为总耗时
+    struct Sample {
+        uint64_t ns[Sayobot::StageTimes::Count + 1];
+    };
+
+    void MakeDir(const std::string& path)
+    {
+        mkdir(path.c_str(), 0755);
+    }
+
+    void WritePlasma(const std::string& path, size_t width, size_t height)
+    {
+        Magick::Image img;
+        img.size(Magick::Geometry(width, height));
+        img.read("plasma:");
+        img.write(path);
+    }
+
+    void WriteSolid(const std::string& path, size_t width, size_t height,
+                    const std::string& color)
+    {
+        Magick::Image img(Magick::Geometry(width, height), Magick::Color(color));
+        img.write(path);
+    }
+
+    // 半透明的圆角框，模拟框框和图标素材
+    void WriteFrame(const std::string& path, size_t width, size_t height,
+                    const std::string& color)
+    {
+        Magick::Image img(Magick::Geometry(width, height), Magick::Color("none"));
+        Magick::DrawableList drawableList;
+        drawableList.push_back(Magick::DrawableStrokeColor(color));
+        drawableList.push_back(Magick::DrawableStrokeWidth(8));
+        drawableList.push_back(Magick::DrawableFillColor("#FFFFFF30"));
+        drawableList.push_back(Magick::DrawableRoundRectangle(
+            4, 4, width - 5.0, height - 5.0, 24, 24));
+        img.draw(drawableList);
+        img.write(path);
+    }
+
+    // 在 root 下生成与线上目录结构相同的合成素材
+    void MakeSyntheticAssets(const std::string& root, int skins)
+    {
+        const char* colors[] = {"#E06C75", "#61AFEF", "#98C379", "#C678DD"};
+        const char* modes[] = {"mode-osu-med", "mode-taiko-med", "mode-fruits-med",
+                               "mode-mania-med"};
+        const char* ranks[] = {"ranking-X-small", "ranking-XH-small", "ranking-S-small",
+                               "ranking-SH-small", "ranking-A-small"};
+        MakeDir(root + "/png");
+        for (const char* dir : {"stat", "tk", "rank", "country", "world", "avatars"})
+            MakeDir(root + "/png/" + dir);
+        for (int i = 0; i < 3; ++i)
+            WritePlasma(root + "/png/stat/bg" + std::to_string(i) + ".png", 1080, 1920);
+        for (int opacity : {0, 50, 80})
+            WriteSolid(root + "/png/fx" + std::to_string(opacity) + ".png",
+                       1080,
+                       1920,
+                       "rgba(0,0,0," + std::to_string(opacity / 100.0) + ")");
+        for (int i = 0; i < 3; ++i)
+        {
+            const std::string prefix = root + "/png/tk/edge" + std::to_string(i);
+            WriteFrame(prefix + "0.png", 1164, 720, colors[i]);
+            WriteFrame(prefix + "1.png", 984, 168, colors[i]);
+            WriteFrame(prefix + "2.png", 990, 180, colors[i]);
+        }
+        for (int k = 0; k < skins; ++k)
+        {
+            const std::string dir = root + "/png/rank/skin" + std::to_string(k);
+            MakeDir(dir);
+            for (const char* mode : modes)
+                WriteFrame(dir + "/" + mode + ".png", 128, 128, colors[k % 4]);
+            for (const char* rank : ranks)
+                WriteFrame(dir + "/" + rank + ".png", 100, 120, colors[(k + 1) % 4]);
+        }
+        for (const char* country : {"__", "CN", "JP"})
+            WritePlasma(root + "/png/country/" + country + ".png", 96, 64);
+        WriteFrame(root + "/png/world/s.png", 128, 128, "#FFFFFF");
+        for (int id = 0; id < 8; ++id)
+            WritePlasma(root + "/png/avatars/" + std::to_string(1000 + id) + ".png", 400, 400);
+        WritePlasma(root + "/png/avatars/no-avatar.png", 400, 400);
+    }
+
+    // 合成的卡片数据，strings 持有 data 中各字段指向的字符串
+    struct SyntheticCard {
+        std::vector<std::string> strings;
+        UserPanelData data;
+
+        char* Keep(const std::string& str)
+        {
+            this->strings.push_back(str);
+            return &this->strings.back()[0];
+        }
+    };
+
+    void MakeCard(SyntheticCard& card, int i, int skins)
+    {
+        const char* colors[] = {"#FFFFFF", "#F0E68C", "#ADD8E6", "#FFB6C1"};
+        const char* countries[] = {"CN", "JP", "__", ""};
+        card.strings.reserve(32); // Keep 返回的指针要求 strings 不重新分配
+        UserPanelData& d = card.data;
+        d.mode = (mode_enum)(i % 4);
+        d.compareDays = i % 2 ? 7 : 0;
+
+        d.uinfo.user_id = 1000 + i % 10; // 1008、1009 没有头像，走 no-avatar
+        d.uinfo.username = card.Keep("player" + std::to_string(i));
+        d.uinfo.country = card.Keep(countries[i % 4]);
+        d.uinfo.n300 = 1200000 + i;
+        d.uinfo.n100 = 90000;
+        d.uinfo.n50 = 8000;
+        d.uinfo.playcount = 15000 + i;
+        d.uinfo.total_score = 8000000000LL + i;
+        d.uinfo.ranked_score = 3500000000LL + i * 1000;
+        d.uinfo.pp = 4321.5f + i;
+        d.uinfo.country_rank = 120 + i;
+        d.uinfo.global_rank = 25000 + i;
+        d.uinfo.count_ssh = 12;
+        d.uinfo.count_ss = 80;
+        d.uinfo.count_sh = 150;
+        d.uinfo.count_s = 900;
+        d.uinfo.count_a = 1400;
+        d.uinfo.level = 100.25f;
+        d.uinfo.accuracy = 98.76;
+
+        d.config.user_id = d.uinfo.user_id;
+        d.config.qq = i % 3 ? 10000 + i : -1;
+        d.config.username = card.Keep(d.uinfo.username);
+        d.config.sign = card.Keep("synthetic card #" + std::to_string(i));
+        d.config.background = card.Keep("bg" + std::to_string(i % 3) + ".png");
+        const std::string edge = "edge" + std::to_string(i % 3);
+        d.config.edge.profile = card.Keep(edge + "0.png");
+        d.config.edge.data = card.Keep(edge + "1.png");
+        d.config.edge.sign = card.Keep(edge + "2.png");
+        d.config.color.profile = card.Keep(colors[i % 4]);
+        d.config.color.data = card.Keep(colors[(i + 1) % 4]);
+        d.config.color.sign = card.Keep(colors[(i + 2) % 4]);
+        d.config.color.time = card.Keep("#FFFFFF");
+        d.config.color.arrowup = card.Keep("#7CFC00");
+        d.config.color.arrowdown = card.Keep("#FF4500");
+        d.config.color.name = card.Keep(colors[(i + 3) % 4]);
+        d.config.skin = card.Keep("skin" + std::to_string(i % skins));
+        const int opacities[] = {0, 50, 80};
+        d.config.opacity = opacities[i % 3];
+
+        // 奇数号的卡片与7天前的数据对比，偶数号没有对比数据
+        d.stat.user_id = i % 2 ? d.uinfo.user_id : -1;
+        d.stat.total_score = d.uinfo.total_score - 1000000;
+        d.stat.ranked_score = d.uinfo.ranked_score - 500000;
+        d.stat.total_hit = d.uinfo.n300 + d.uinfo.n100 + d.uinfo.n50 - 3000;
+        d.stat.accuracy = 98.70;
+        d.stat.pp = d.uinfo.pp - 12.5f;
+        d.stat.level = d.uinfo.level - 0.1f;
+        d.stat.global_rank = d.uinfo.global_rank + 150;
+        d.stat.country_rank = d.uinfo.country_rank + 3;
+        d.stat.playcount = d.uinfo.playcount - 40;
+        d.stat.xh = 12;
+        d.stat.x = 79;
+        d.stat.sh = 148;
+        d.stat.s = 890;
+        d.stat.a = 1395;
+        d.stat.mode = d.mode;
+        d.stat.days = 7;
+    }
+
+    uint64_t Percentile(std::vector<uint64_t>& values, double p)
+    {
+        if (values.empty())
+            return 0;
+        std::sort(values.begin(), values.end());
+        size_t index = (size_t)(p * (values.size() - 1) + 0.5);
+        return values[index];
+    }
+
+    void Usage(const char* argv0)
+    {
+        fprintf(stderr,
+                "usage: %s (--font FILE | --assets DIR) [-n CARDS] [-t THREADS] "
+                "[-f FORMAT] [--skins N] [--cold] [--scale S] "
+                "[--policy auto|wide|narrow|off]\n",
+                argv0);
+    }
+} // namespace
+
+int main(int argc, char** argv)
+{
+    BenchOptions opt;
+    for (int i = 1; i < argc; ++i)
+    {
+        const std::string arg = argv[i];
+        const bool has_value = i + 1 < argc;
+        if (arg == "-n" && has_value)
+            opt.cards = atoi(argv[++i]);
+        else if (arg == "-t" && has_value)
+            opt.threads = atoi(argv[++i]);
+        else if (arg == "-f" && has_value)
+            opt.format = argv[++i];
+        else if (arg == "--skins" && has_value)
+            opt.skins = atoi(argv[++i]);
+        else if (arg == "--assets" && has_value)
+            opt.assets = argv[++i];
+        else if (arg == "--font" && has_value)
+            opt.font = argv[++i];
+        else if (arg == "--cold")
+            opt.cold = true;
+        else if (arg == "--scale" && has_value)
+            opt.scale = atof(argv[++i]);
+        else if (arg == "--policy" && has_value
+                 && Sayobot::ThreadBudget::ParsePolicy(argv[i + 1], opt.policy))
+            ++i;
+        else
+        {
+            Usage(argv[0]);
+            return 2;
+        }
+    }
+    if ((opt.assets.empty() && opt.font.empty()) || opt.cards <= 0 || opt.threads <= 0
+        || opt.skins <= 0 || opt.scale <= 0)
+    {
+        Usage(argv[0]);
+        return 2;
+    }
+
+    Magick::InitializeMagick(argv[0]);
+    Sayobot_SetThreadPolicy(opt.policy, -1, -1);
+    Sayobot_Context* ctx = Sayobot_CreateContext();
+    std::string root = opt.assets;
+    if (root.empty())
+    {
+        char dir[] = "/tmp/syb_bench.XXXXXX";
+        if (!mkdtemp(dir))
+        {
+            perror("mkdtemp");
+            return 1;
+        }
+        root = dir;
+        fprintf(stderr, "generating synthetic assets in %s\n", dir);
+        MakeSyntheticAssets(root, opt.skins);
+    }
+    Sayobot_CtxSetPath(ctx, "background", (root + "/png/stat/").c_str());
+    Sayobot_CtxSetPath(ctx, "edge", (root + "/png/tk/").c_str());
+    Sayobot_CtxSetPath(ctx, "skin", (root + "/png/rank/").c_str());
+    Sayobot_CtxSetPath(ctx, "country", (root + "/png/country/").c_str());
+    Sayobot_CtxSetPath(ctx, "global", (root + "/png/world/s.png").c_str());
+    Sayobot_CtxSetPath(ctx, "avatar", (root + "/png/avatars/").c_str());
+    Sayobot_CtxSetPath(ctx, "opacity", (root + "/png/").c_str());
+    Sayobot_CtxSetPath(ctx, "font", (root + "/fonts/").c_str());
+    if (!opt.font.empty())
+    {
+        const size_t slash = opt.font.find_last_of('/');
+        const std::string dir = slash == std::string::npos ? "./" : opt.font.substr(0, slash + 1);
+        const std::string file = opt.font.substr(slash == std::string::npos ? 0 : slash + 1);
+        Sayobot_CtxSetPath(ctx, "font", dir.c_str());
+        for (const char* key : {"profile", "data", "sign", "time", "arrow", "name"})
+            Sayobot_CtxSetFont(ctx, key, file.c_str());
+    }
+
+    std::string magick;
+    Sayobot::EncodeOptions encode;
+    if (!ParseEncodeSpec(ctx, opt.format.c_str(), magick, encode))
+    {
+        fprintf(stderr, "unsupported format: %s\n", opt.format.c_str());
+        return 2;
+    }
+
+    std::vector<SyntheticCard> cards(opt.cards);
+    for (int i = 0; i < opt.cards; ++i)
+        MakeCard(cards[i], i, opt.skins);
+
+    std::vector<std::vector<Sample>> samples(opt.threads);
+    std::atomic<int> failures(0);
+    const auto start = std::chrono::steady_clock::now();
+    {
+        std::vector<std::thread> workers;
+        for (int t = 0; t < opt.threads; ++t)
+        {
+            workers.emplace_back([&, t] {
+                for (int i = t; i < opt.cards; i += opt.threads)
+                {
+                    if (opt.cold)
+                    {
+                        ctx->assets.Clear();
+                        ctx->layers.Clear();
+                    }
+                    Sayobot::StageTimes& times = Sayobot::StageTimes::Current();
+                    times.Reset();
+                    const auto begin = std::chrono::steady_clock::now();
+                    try
+                    {
+                        Magick::Blob blob;
+                        RenderCard(ctx, &cards[i].data, opt.scale, [&](Sayobot::Image& image) {
+                            image.Save(blob, magick, encode);
+                        });
+                    }
+                    catch (Magick::Exception& ex)
+                    {
+                        ++failures;
+                        fprintf(stderr, "card %d: %s\n", i, ex.what());
+                        continue;
+                    }
+                    Sample sample;
+                    for (int k = 0; k < Sayobot::StageTimes::Count; ++k)
+                        sample.ns[k] = times.ns[k];
+                    sample.ns[Sayobot::StageTimes::Count] =
+                        std::chrono::duration_cast<std::chrono::nanoseconds>(
+                            std::chrono::steady_clock::now() - begin)
+                            .count();
+                    samples[t].push_back(sample);
+                }
+            });
+        }
+        for (auto& worker : workers)
+            worker.join();
+    }
+    const double elapsed = std::chrono::duration<double>(
+                               std::chrono::steady_clock::now() - start)
+                               .count();
+
+    std::vector<Sample> all;
+    for (const auto& part : samples)
+        all.insert(all.end(), part.begin(), part.end());
+    printf("cards: %d  threads: %d  format: %s  skins: %d  scale: %g  cache: %s  "
+           "compositor: %s  magick: %s  policy: %s  failures: %d\n",
+           opt.cards,
+           opt.threads,
+           opt.format.c_str(),
+           opt.skins,
+           opt.scale,
+           opt.cold ? "cold" : "warm",
+           Sayobot::Compositor::KernelName(),
+           Sayobot::QuantumTraits::Name(),
+           Sayobot::ThreadBudget::PolicyName(opt.policy),
+           failures.load());
+    printf("throughput: %.2f cards/s (%.3f s)\n", all.size() / elapsed, elapsed);
+    printf("%-10s %10s %10s %10s %10s\n", "stage", "p50(ms)", "p95(ms)", "p99(ms)", "mean(ms)");
+    for (int k = 0; k <= Sayobot::StageTimes::Count; ++k)
+    {
+        std::vector<uint64_t> values;
+        uint64_t sum = 0;
+        for (const auto& sample : all)
+        {
+            values.push_back(sample.ns[k]);
+            sum += sample.ns[k];
+        }
+        printf("%-10s %10.3f %10.3f %10.3f %10.3f\n",
+               k == Sayobot::StageTimes::Count ? "total" : Sayobot::StageTimes::Name(k),
+               Percentile(values, 0.50) / 1e6,
+               Percentile(values, 0.95) / 1e6,
+               Percentile(values, 0.99) / 1e6,
+               values.empty() ? 0.0 : sum / 1e6 / values.size());
+    }
+    Sayobot_DestroyContext(ctx);
+    return failures ? 1 : 0;
+}
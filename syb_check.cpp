@@ -0,0 +1,224 @@
+/*
+ * 自检工具：检查不需要素材和字体的逻辑（输出缓存的键、卡片名、扁平数据的校验、素材尺寸的换算、
+ * 快照库的追加等）
+ * 用法:
+ *** syb_check
+ * 全部通过时返回0，否则打印失败的项目并返回1
+ */
+#include "syb.cpp"
+
+#include <signal.h>
+#include <stdio.h>
+#include <sys/resource.h>
+
+namespace
+{
+    int failures = 0;
+
+    void Check(bool ok, const char* what)
+    {
+        printf("%s %s\n", ok ? "ok  " : "FAIL", what);
+        if (!ok)
+            ++failures;
+    }
+
+    // 没有对比数据（stat.user_id == -1）的卡片数据，字符串都指向静态的字符串
+    UserPanelData MakePanel()
+    {
+        static char empty[] = "", name[] = "sayobot", country[] = "CN", color[] = "#ffffff";
+        UserPanelData data = UserPanelData();
+        data.uinfo.user_id = 1;
+        data.uinfo.username = name;
+        data.uinfo.country = country;
+        data.uinfo.country_rank = 100;
+        data.config.qq = -1;
+        data.config.sign = empty;
+        data.config.background = empty;
+        data.config.edge.profile = data.config.edge.data = data.config.edge.sign = empty;
+        for (char** c : {&data.config.color.profile, &data.config.color.data,
+                         &data.config.color.sign, &data.config.color.time,
+                         &data.config.color.arrowup, &data.config.color.arrowdown,
+                         &data.config.color.name})
+            *c = color;
+        data.config.skin = empty;
+        data.stat.user_id = -1;
+        data.stat.total_hit = 1000;
+        data.stat.country_rank = 50;
+        return data;
+    }
+
+    // 没有对比数据时 DrawCard 仍然用 stat.total_hit 和 stat.country_rank 画 Total Hits
+    void CheckOutputKey()
+    {
+        Sayobot_Context* ctx = Sayobot_CreateContext();
+        const Sayobot::EncodeOptions options;
+        const UserPanelData a = MakePanel();
+        UserPanelData b = a;
+        const uint64_t key = OutputKey(ctx, &a, "PNG", options, 1.0);
+        Check(OutputKey(ctx, &b, "PNG", options, 1.0) == key, "output key: same input, same key");
+        b.stat.total_hit += 1;
+        Check(OutputKey(ctx, &b, "PNG", options, 1.0) != key,
+              "output key: stat.total_hit without comparison data");
+        b = a;
+        b.stat.country_rank += 1;
+        Check(OutputKey(ctx, &b, "PNG", options, 1.0) != key,
+              "output key: stat.country_rank without comparison data");
+        // 键不包含素材文件和页脚时间，默认不缓存结果，旧的调用方得到的卡片不会过期
+        Check(Sayobot_CtxSetOutputTtl(ctx, -1) == 0, "output cache: off by default");
+        Sayobot_DestroyContext(ctx);
+    }
+
+    // 不同缩放比例的卡片不能同名，否则保存到磁盘时互相覆盖
+    void CheckCardName()
+    {
+        Sayobot_Context* ctx = Sayobot_CreateContext();
+        const UserPanelData data = MakePanel();
+        char full[17], again[17], half[17];
+        Sayobot_CtxCardName(ctx, &data, full, sizeof(full));
+        Sayobot_CtxCardName(ctx, &data, again, sizeof(again));
+        Check(!strcmp(full, again), "card name: same input, same name");
+        Sayobot_CtxSetScale(ctx, 0.5);
+        Sayobot_CtxCardName(ctx, &data, half, sizeof(half));
+        Check(strcmp(full, half) != 0, "card name: scale is part of the name");
+        Sayobot_DestroyContext(ctx);
+    }
+
+    // data 扁平化之后能否通过 PanelDataView
+    bool FlatAccepted(const UserPanelData& data)
+    {
+        std::vector<uint64_t> buf(Sayobot_FlattenPanel(&data, NULL, 0) / 8 + 1);
+        const size_t len = Sayobot_FlattenPanel(&data, buf.data(), buf.size() * 8);
+        UserPanelData view;
+        return PanelDataView(buf.data(), len, view);
+    }
+
+    // 渲染时拼进固定大小缓冲区的字符串有长度上限，直接使用的字符串不能为NULL
+    void CheckFlatView()
+    {
+        Check(FlatAccepted(MakePanel()), "flat view: valid panel");
+        std::string name(SAYOBOT_FLAT_NAME_MAX, 'a'), text(SAYOBOT_FLAT_TEXT_MAX, 'a');
+        UserPanelData data = MakePanel();
+        data.config.background = &name[0];
+        data.config.sign = &text[0];
+        Check(FlatAccepted(data), "flat view: strings at the length limit");
+        std::string long_name(600, 'a'), long_text(SAYOBOT_FLAT_TEXT_MAX + 1, 'a');
+        data = MakePanel();
+        data.config.background = &long_name[0];
+        Check(!FlatAccepted(data), "flat view: rejects a 600-byte background");
+        data = MakePanel();
+        data.config.sign = &long_text[0];
+        Check(!FlatAccepted(data), "flat view: rejects an over-long sign");
+        data = MakePanel();
+        data.config.color.sign = NULL;
+        Check(!FlatAccepted(data), "flat view: rejects a NULL color");
+        data = MakePanel();
+        data.config.sign = NULL;
+        Check(!FlatAccepted(data), "flat view: rejects a NULL sign");
+        data = MakePanel();
+        data.uinfo.country = NULL;
+        data.stat.username = NULL;
+        Check(FlatAccepted(data), "flat view: optional strings may be NULL");
+    }
+
+    // 预加载和素材包的尺寸按比例换算，与渲染时 Sprite 请求的尺寸一致
+    void CheckScaledAssets()
+    {
+        char dir[] = "/tmp/syb_check.XXXXXX";
+        if (!mkdtemp(dir))
+        {
+            Check(false, "scaled assets: temporary directory");
+            return;
+        }
+        const std::string edge = std::string(dir) + "/edge.png";
+        fclose(fopen(edge.c_str(), "wb"));
+        Sayobot_Context* ctx = Sayobot_CreateContext();
+        ctx->edge = std::string(dir) + "/";
+        std::vector<CardAsset> full, half;
+        CollectCardAssets(ctx, CARD_ASSET_EDGE, full);
+        CollectCardAssets(ctx, CARD_ASSET_EDGE, half, 0.5);
+        bool same = full.size() == 3 && half.size() == full.size();
+        for (size_t i = 0; same && i < full.size(); ++i)
+            same = half[i].width == Sayobot::Image::ScaleSize(full[i].width, 0.5)
+                   && half[i].height == Sayobot::Image::ScaleSize(full[i].height, 0.5);
+        Check(same, "scaled assets: sizes match Sprite at scale 0.5");
+        Check(same && half[2].width == 413 && half[2].height == 75,
+              "scaled assets: 825x150 rounds to 413x75");
+        Sayobot_DestroyContext(ctx);
+        remove(edge.c_str());
+        rmdir(dir);
+    }
+
+    UserStatData MakeStat(int mode, int32_t user_id, time_t timestamp)
+    {
+        UserStatData stat = UserStatData();
+        stat.user_id = user_id;
+        stat.mode = (mode_enum)mode;
+        stat.update_timestamp = timestamp;
+        return stat;
+    }
+
+    uint64_t StatCount(Sayobot_StatStore* store)
+    {
+        uint64_t count = 0;
+        for (const auto& mode : store->modes)
+            count += mode->Snapshots();
+        return count;
+    }
+
+    // 各个模式的快照一起追加：一个模式出错时其他模式也不写入
+    void CheckStatAppend()
+    {
+        char dir[] = "/tmp/syb_check.XXXXXX";
+        Sayobot_StatStore* store = mkdtemp(dir) ? Sayobot_StatOpen(dir) : NULL;
+        if (!store)
+        {
+            Check(false, "stat append: open store");
+            return;
+        }
+        UserStatData items[2] = {MakeStat(0, 1, 1000), MakeStat(1, 1, 1000)};
+        Check(Sayobot_StatAppend(store, items, 2) == SAYOBOT_OK && StatCount(store) == 2,
+              "stat append: two modes");
+        items[0] = MakeStat(0, 1, 2000);
+        items[1] = MakeStat(1, 1, 500);
+        Check(Sayobot_StatAppend(store, items, 2) == SAYOBOT_EINVAL && StatCount(store) == 2,
+              "stat append: out of order in one mode writes no mode");
+
+        // 文件大小的上限使第二个模式写入失败
+        std::vector<UserStatData> batch;
+        batch.push_back(MakeStat(0, 2, 1000));
+        for (int i = 0; i < 4096; ++i)
+            batch.push_back(MakeStat(1, 1000 + i, 1000));
+        const uint64_t before = store->modes[0]->Bytes();
+        struct rlimit saved, limit;
+        getrlimit(RLIMIT_FSIZE, &saved);
+        limit = saved;
+        limit.rlim_cur = (rlim_t)std::max(before, store->modes[1]->Bytes()) + 4096;
+        signal(SIGXFSZ, SIG_IGN);
+        setrlimit(RLIMIT_FSIZE, &limit);
+        const int status = Sayobot_StatAppend(store, batch.data(), batch.size());
+        setrlimit(RLIMIT_FSIZE, &saved);
+        Check(status == SAYOBOT_EIO, "stat append: write failure is SAYOBOT_EIO");
+        Check(StatCount(store) == 2 && store->modes[0]->Bytes() == before,
+              "stat append: write failure rolls back the other modes");
+        items[0] = MakeStat(0, 1, 3000);
+        items[1] = MakeStat(1, 1, 3000);
+        Check(Sayobot_StatAppend(store, items, 2) == SAYOBOT_OK && StatCount(store) == 4,
+              "stat append: usable after a failure");
+        Sayobot_StatClose(store);
+        for (const char* name : {"std", "taiko", "ctb", "mania"})
+            remove((std::string(dir) + "/stat-" + name + ".sybstat").c_str());
+        rmdir(dir);
+    }
+} // namespace
+
+int main(int, char** argv)
+{
+    Magick::InitializeMagick(argv[0]);
+    CheckOutputKey();
+    CheckCardName();
+    CheckFlatView();
+    CheckScaledAssets();
+    CheckStatAppend();
+    printf("%d failed\n", failures);
+    return failures ? 1 : 0;
+}
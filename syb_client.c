@@ -0,0 +1,233 @@
+/*
+ * sayobot-renderd 的C客户端，协议见 syb_client.h
+ * 以 -DSAYOBOT_CLIENT_MAIN 编译时为命令行工具 syb_render（见 build_client.sh）:
+ *** syb_render -s 套接字 [-f 编码描述] [-o 输出前缀] 卡片数据文件...
+ *** syb_render -s 套接字 --ping
+ * 所有请求一次发出（流水线），再依次接收响应，第 i 个文件的结果保存为 <输出前缀><i>
+ */
+#include "syb_client.h"
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+struct Sayobot_Client {
+    int fd;
+    uint32_t next_id;
+};
+
+static int WriteAll(int fd, const void* data, size_t len) {
+    const char* p = (const char*)data;
+    while (len) {
+        ssize_t n = write(fd, p, len);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return -1;
+        p += n;
+        len -= (size_t)n;
+    }
+    return 0;
+}
+
+static int ReadAll(int fd, void* data, size_t len) {
+    char* p = (char*)data;
+    while (len) {
+        ssize_t n = read(fd, p, len);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return -1;
+        p += n;
+        len -= (size_t)n;
+    }
+    return 0;
+}
+
+Sayobot_Client* Sayobot_ClientConnect(const char* socket_path) {
+    struct sockaddr_un addr;
+    if (!socket_path || strlen(socket_path) >= sizeof(addr.sun_path)) return NULL;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, socket_path);
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0) return NULL;
+    if (connect(fd, (struct sockaddr*)&addr, sizeof(addr)) != 0) {
+        close(fd);
+        return NULL;
+    }
+    Sayobot_Client* client = (Sayobot_Client*)malloc(sizeof(Sayobot_Client));
+    if (!client) {
+        close(fd);
+        return NULL;
+    }
+    client->fd = fd;
+    client->next_id = 1;
+    return client;
+}
+
+void Sayobot_ClientClose(Sayobot_Client* client) {
+    if (!client) return;
+    close(client->fd);
+    free(client);
+}
+
+static uint32_t SendFrame(Sayobot_Client* client, int32_t type, const void* head, size_t head_len,
+                          const void* body, size_t body_len) {
+    Sayobot_Frame frame;
+    if (head_len + body_len > SAYOBOT_FRAME_MAX) return 0;
+    frame.magic = SAYOBOT_FRAME_MAGIC;
+    frame.id = client->next_id++;
+    if (!client->next_id) client->next_id = 1;
+    frame.code = type;
+    frame.length = (uint32_t)(head_len + body_len);
+    if (WriteAll(client->fd, &frame, sizeof(frame)) != 0
+        || (head_len && WriteAll(client->fd, head, head_len) != 0)
+        || (body_len && WriteAll(client->fd, body, body_len) != 0))
+        return 0;
+    return frame.id;
+}
+
+uint32_t Sayobot_ClientSend(Sayobot_Client* client, const char* format, const void* panel,
+                            size_t panel_len) {
+    if (!format) format = "png";
+    const size_t format_len = strlen(format) + 1;
+    if (format_len > SAYOBOT_FRAME_FORMAT_MAX || !panel) return 0;
+    return SendFrame(client, SAYOBOT_FRAME_RENDER, format, format_len, panel, panel_len);
+}
+
+uint32_t Sayobot_ClientPing(Sayobot_Client* client) {
+    return SendFrame(client, SAYOBOT_FRAME_PING, NULL, 0, NULL, 0);
+}
+
+int Sayobot_ClientRecv(Sayobot_Client* client, uint32_t* id, int* status, unsigned char** data,
+                       size_t* len) {
+    Sayobot_Frame frame;
+    *data = NULL;
+    *len = 0;
+    if (ReadAll(client->fd, &frame, sizeof(frame)) != 0 || frame.magic != SAYOBOT_FRAME_MAGIC
+        || frame.length > SAYOBOT_FRAME_MAX)
+        return -1;
+    unsigned char* payload = (unsigned char*)malloc(frame.length ? frame.length : 1);
+    if (!payload || ReadAll(client->fd, payload, frame.length) != 0) {
+        free(payload);
+        return -1;
+    }
+    *id = frame.id;
+    *status = frame.code;
+    *data = payload;
+    *len = frame.length;
+    return 0;
+}
+
+int Sayobot_ClientRender(Sayobot_Client* client, const char* format, const void* panel,
+                         size_t panel_len, unsigned char** data, size_t* len) {
+    uint32_t id, sent = Sayobot_ClientSend(client, format, panel, panel_len);
+    int status;
+    *data = NULL;
+    *len = 0;
+    if (!sent || Sayobot_ClientRecv(client, &id, &status, data, len) != 0) return -3;
+    if (id != sent) {
+        Sayobot_ClientFree(*data);
+        *data = NULL;
+        *len = 0;
+        return -3;
+    }
+    return status;
+}
+
+void Sayobot_ClientFree(unsigned char* data) {
+    free(data);
+}
+
+#ifdef SAYOBOT_CLIENT_MAIN
+static unsigned char* ReadFile(const char* path, size_t* len) {
+    FILE* file = fopen(path, "rb");
+    unsigned char* data = NULL;
+    long size;
+    if (!file) return NULL;
+    if (fseek(file, 0, SEEK_END) == 0 && (size = ftell(file)) > 0 && fseek(file, 0, SEEK_SET) == 0
+        && (data = (unsigned char*)malloc((size_t)size))
+        && fread(data, 1, (size_t)size, file) != (size_t)size) {
+        free(data);
+        data = NULL;
+    }
+    fclose(file);
+    *len = data ? (size_t)size : 0;
+    return data;
+}
+
+int main(int argc, char** argv) {
+    const char *socket_path = NULL, *format = "png", *prefix = "card-";
+    int ping = 0, first = argc, i;
+    for (i = 1; i < argc; ++i) {
+        if (!strcmp(argv[i], "-s") && i + 1 < argc) socket_path = argv[++i];
+        else if (!strcmp(argv[i], "-f") && i + 1 < argc) format = argv[++i];
+        else if (!strcmp(argv[i], "-o") && i + 1 < argc) prefix = argv[++i];
+        else if (!strcmp(argv[i], "--ping")) ping = 1;
+        else if (argv[i][0] == '-') break;
+        else {
+            first = i;
+            break;
+        }
+    }
+    if (!socket_path || (!ping && first == argc) || i < first) {
+        fprintf(stderr, "usage: %s -s SOCKET [-f FORMAT] [-o PREFIX] PANEL... | --ping\n", argv[0]);
+        return 2;
+    }
+    Sayobot_Client* client = Sayobot_ClientConnect(socket_path);
+    if (!client) {
+        perror(socket_path);
+        return 1;
+    }
+    const int count = ping ? 1 : argc - first;
+    uint32_t* ids = (uint32_t*)calloc((size_t)count, sizeof(uint32_t));
+    for (i = 0; i < count; ++i) {
+        size_t len;
+        unsigned char* panel = ping ? NULL : ReadFile(argv[first + i], &len);
+        if (!ping && !panel) {
+            perror(argv[first + i]);
+            continue;
+        }
+        ids[i] = ping ? Sayobot_ClientPing(client) : Sayobot_ClientSend(client, format, panel, len);
+        free(panel);
+    }
+    int failed = 0;
+    for (i = 0; i < count; ++i) {
+        uint32_t id;
+        int status, j;
+        unsigned char* data;
+        size_t len;
+        if (!ids[i]) {
+            ++failed;
+            continue;
+        }
+        if (Sayobot_ClientRecv(client, &id, &status, &data, &len) != 0) {
+            fprintf(stderr, "connection closed\n");
+            failed += count - i;
+            break;
+        }
+        for (j = 0; j < count && ids[j] != id; ++j) {}
+        if (j == count) {
+            fprintf(stderr, "unexpected response %u\n", id);
+            ++failed;
+        } else if (status != 0) {
+            fprintf(stderr, "request %u: status %d: %.*s\n", id, status, (int)len, data);
+            ++failed;
+        } else if (ping) {
+            printf("%.*s\n", (int)len, data);
+        } else {
+            char path[4096];
+            snprintf(path, sizeof(path), "%s%d", prefix, j);
+            FILE* out = fopen(path, "wb");
+            if (!out || fwrite(data, 1, len, out) != len) ++failed;
+            if (out) fclose(out);
+            printf("%s: %zu bytes\n", path, len);
+        }
+        Sayobot_ClientFree(data);
+    }
+    free(ids);
+    Sayobot_ClientClose(client);
+    return failed ? 1 : 0;
+}
+#endif
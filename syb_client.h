@@ -0,0 +1,74 @@
+/*
+ * sayobot-renderd 的协议和C客户端
+ * 连接为 Unix 域套接字上的一串帧，每帧是 Sayobot_Frame 加上 length 字节的负载（主机字节序）
+ *** 请求：code 为 Sayobot_FrameType，id 由客户端选择，响应原样带回
+ *** SAYOBOT_FRAME_RENDER 的负载为以\0结尾的编码描述（如 png、webp:fast:80），
+ *** 紧接着是扁平形式的卡片数据（Sayobot_FlatPanel，见 Sayobot_FlattenPanel）
+ *** SAYOBOT_FRAME_PING 没有负载
+ *** 响应：code 为 Sayobot_Status（0 为成功），成功时负载为编码后的图片，失败时为错误信息
+ * 同一连接上可以连续发送多个请求而不等待响应（流水线），响应按 id 对应
+ */
+#ifndef SYB_CLIENT_H
+#define SYB_CLIENT_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define SAYOBOT_FRAME_MAGIC 0x52425953u    /* "SYBR" */
+#define SAYOBOT_FRAME_MAX (16u << 20)      /* 单帧负载的上限 */
+#define SAYOBOT_FRAME_FORMAT_MAX 64        /* 编码描述（含\0）的上限 */
+
+typedef struct Sayobot_Frame {
+    uint32_t magic;  /* SAYOBOT_FRAME_MAGIC */
+    uint32_t id;     /* 请求号 */
+    int32_t code;    /* 请求为 Sayobot_FrameType，响应为 Sayobot_Status */
+    uint32_t length; /* 之后的负载字节数 */
+} Sayobot_Frame;
+
+enum Sayobot_FrameType {
+    SAYOBOT_FRAME_RENDER = 1,
+    SAYOBOT_FRAME_PING = 2
+};
+
+typedef struct Sayobot_Client Sayobot_Client;
+
+/* 连接到 sayobot-renderd，失败时返回NULL */
+Sayobot_Client* Sayobot_ClientConnect(const char* socket_path);
+
+void Sayobot_ClientClose(Sayobot_Client* client);
+
+/*
+ * 发送渲染请求，不等待响应；返回请求号，失败时返回0
+ * panel 为扁平形式的卡片数据，format 为NULL时为png
+ */
+uint32_t Sayobot_ClientSend(Sayobot_Client* client, const char* format, const void* panel,
+                            size_t panel_len);
+
+/* 发送 ping，不等待响应；返回请求号，失败时返回0 */
+uint32_t Sayobot_ClientPing(Sayobot_Client* client);
+
+/*
+ * 接收下一个响应（任意请求的），填入请求号、状态和负载
+ * *data 使用 Sayobot_ClientFree 释放；返回0，连接断开或协议错误时返回-1
+ */
+int Sayobot_ClientRecv(Sayobot_Client* client, uint32_t* id, int* status, unsigned char** data,
+                       size_t* len);
+
+/*
+ * 发送一个请求并等待它的响应（连接上不能有其他未完成的请求）
+ * 返回 Sayobot_Status，连接错误时返回-3（SAYOBOT_EUNKNOWN）
+ */
+int Sayobot_ClientRender(Sayobot_Client* client, const char* format, const void* panel,
+                         size_t panel_len, unsigned char** data, size_t* len);
+
+void Sayobot_ClientFree(unsigned char* data);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
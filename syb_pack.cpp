@@ -0,0 +1,224 @@
+/*
+ * 素材包的打包工具：把素材预先解码并缩放成 MakePersonalCard 使用的尺寸，保存为预乘的RGBA8像素，
+ * 由 Sayobot_CtxLoadBundle 映射到内存后直接使用，不再需要解码
+ * 用法:
+ *** syb_pack -o 输出文件 [--background 目录] [--opacity 目录] [--edge 目录] [--skin 目录]
+ ***          [--country 目录] [--avatar 目录] [--global 文件] [--entry 文件 宽 高] [-t 线程数]
+ ***          [--scale 比例]...
+ * 目录和文件要与 Sayobot_CtxSetPath 设置的值完全相同（通常以 / 结尾），
+ * 包中的名字就是两者直接拼接的结果，与渲染时 DrawPic 使用的路径一致
+ * --scale 与 Sayobot_CtxSetScale 的比例相同，可重复指定，每个比例各打包一份（默认只有1）；
+ * --entry 的尺寸不换算
+ * 素材修改后需要重新打包
+ */
+#include "syb.cpp"
+
+#include <stdio.h>
+
+#include <set>
+
+namespace
+{
+    // 要打包的一项：素材路径和请求的尺寸（都为0时不缩放）
+    struct PackJob {
+        std::string path;
+        size_t width, height;
+
+        bool operator<(const PackJob& rhs) const
+        {
+            return path != rhs.path ? path < rhs.path
+                   : width != rhs.width ? width < rhs.width
+                                        : height < rhs.height;
+        }
+    };
+
+    // 把 offset 补齐到 align 的倍数
+    void Pad(FILE* out, uint64_t& offset, uint64_t align)
+    {
+        static const char zeros[64] = {0};
+        const uint64_t padding = (align - offset % align) % align;
+        fwrite(zeros, 1, (size_t)padding, out);
+        offset += padding;
+    }
+
+    void Usage(const char* argv0)
+    {
+        fprintf(stderr,
+                "usage: %s -o FILE [--background DIR] [--opacity DIR] [--edge DIR] "
+                "[--skin DIR] [--country DIR] [--avatar DIR] [--global FILE] "
+                "[--entry FILE WIDTH HEIGHT] [-t THREADS] [--scale S]...\n",
+                argv0);
+    }
+} // namespace
+
+int main(int argc, char** argv)
+{
+    std::string output;
+    int threads = 0;
+    int kinds = 0;
+    std::set<PackJob> jobs;
+    std::set<double> scales;
+    // 路径设置在一个上下文中，与 Sayobot_Preload 用同样的方式列出素材
+    Sayobot_Context* ctx = Sayobot_CreateContext();
+    const struct {
+        const char* option;
+        std::string* path;
+        int kind;
+    } paths[] = {
+        {"--background", &ctx->background, CARD_ASSET_BACKGROUND},
+        {"--opacity", &ctx->opacity, CARD_ASSET_OPACITY},
+        {"--edge", &ctx->edge, CARD_ASSET_EDGE},
+        {"--skin", &ctx->skin, CARD_ASSET_SKIN},
+        {"--country", &ctx->country, CARD_ASSET_COUNTRY},
+        {"--avatar", &ctx->avatar, CARD_ASSET_AVATAR},
+        {"--global", &ctx->global, CARD_ASSET_GLOBAL},
+    };
+    for (int i = 1; i < argc; ++i)
+    {
+        const std::string arg = argv[i];
+        const bool has_value = i + 1 < argc;
+        bool matched = false;
+        for (const auto& p : paths)
+        {
+            if (arg == p.option && has_value)
+            {
+                *p.path = argv[++i];
+                kinds |= p.kind;
+                matched = true;
+            }
+        }
+        if (matched)
+            continue;
+        if (arg == "-o" && has_value)
+            output = argv[++i];
+        else if (arg == "-t" && has_value)
+            threads = atoi(argv[++i]);
+        else if (arg == "--scale" && has_value)
+        {
+            const double scale = atof(argv[++i]);
+            if (scale <= 0)
+            {
+                Usage(argv[0]);
+                return 2;
+            }
+            scales.insert(scale);
+        }
+        else if (arg == "--entry" && i + 3 < argc)
+        {
+            jobs.insert(
+                PackJob{argv[i + 1], (size_t)atoi(argv[i + 2]), (size_t)atoi(argv[i + 3])});
+            i += 3;
+        }
+        else
+        {
+            Usage(argv[0]);
+            return 2;
+        }
+    }
+    // 不指定尺寸的素材在比例不为1时要读取原尺寸，先初始化 Magick
+    Magick::InitializeMagick(argv[0]);
+    if (scales.empty())
+        scales.insert(1.0);
+    for (double scale : scales)
+    {
+        std::vector<CardAsset> assets;
+        CollectCardAssets(ctx, kinds, assets, scale);
+        for (const CardAsset& asset : assets)
+            jobs.insert(PackJob{asset.path, asset.width, asset.height});
+    }
+    Sayobot_DestroyContext(ctx);
+    if (output.empty() || jobs.empty() || threads < 0)
+    {
+        Usage(argv[0]);
+        return 2;
+    }
+
+    FILE* out = fopen(output.c_str(), "wb");
+    if (!out)
+    {
+        perror(output.c_str());
+        return 1;
+    }
+    Sayobot::AssetBundle::Header header;
+    memset(&header, 0, sizeof(header));
+    fwrite(&header, sizeof(header), 1, out);
+    uint64_t offset = sizeof(header);
+
+    // 解码和缩放并行进行（与 AssetCache 相同的方式），写入文件时加锁
+    std::mutex mutex;
+    std::vector<Sayobot::AssetBundle::Entry> entries;
+    std::string names;
+    size_t failed = 0;
+    {
+        Sayobot::ThreadPool pool(threads);
+        for (const PackJob& job : jobs)
+        {
+            pool.Submit([&, job] {
+                try
+                {
+                    Magick::Image img;
+                    img.read(job.path);
+                    if (job.width && job.height)
+                        img.resize(Magick::Geometry(job.width, job.height));
+                    const Sayobot::Raster raster = Sayobot::Raster::FromMagick(img);
+
+                    std::lock_guard<std::mutex> lock(mutex);
+                    Pad(out, offset, 64);
+                    Sayobot::AssetBundle::Entry entry;
+                    entry.hash = Sayobot::AssetBundle::Key(job.path, job.width, job.height);
+                    entry.offset = offset;
+                    entry.name_offset = (uint32_t)names.size();
+                    entry.name_length = (uint32_t)job.path.size();
+                    entry.key_width = (uint32_t)job.width;
+                    entry.key_height = (uint32_t)job.height;
+                    entry.width = (uint32_t)raster.Width();
+                    entry.height = (uint32_t)raster.Height();
+                    if (raster.Bytes())
+                        fwrite(raster.Row(0), 1, raster.Bytes(), out);
+                    offset += raster.Bytes();
+                    names += job.path;
+                    entries.push_back(entry);
+                }
+                catch (Magick::Exception& ex)
+                {
+                    std::lock_guard<std::mutex> lock(mutex);
+                    fprintf(stderr, "skip %s: %s\n", job.path.c_str(), ex.what());
+                    ++failed;
+                }
+            });
+        }
+        pool.Wait();
+    }
+
+    std::sort(entries.begin(),
+              entries.end(),
+              [](const Sayobot::AssetBundle::Entry& a, const Sayobot::AssetBundle::Entry& b) {
+                  return a.hash < b.hash;
+              });
+    Pad(out, offset, 8);
+    header.index_offset = offset;
+    if (!entries.empty())
+        fwrite(&entries[0], sizeof(entries[0]), entries.size(), out);
+    offset += sizeof(entries[0]) * entries.size();
+    header.names_offset = offset;
+    fwrite(names.data(), 1, names.size(), out);
+    offset += names.size();
+
+    memcpy(header.magic, Sayobot::AssetBundle::Magic(), 8);
+    header.version = Sayobot::AssetBundle::Version;
+    header.count = (uint32_t)entries.size();
+    header.file_size = offset;
+    fseek(out, 0, SEEK_SET);
+    fwrite(&header, sizeof(header), 1, out);
+    if (fclose(out) != 0)
+    {
+        perror(output.c_str());
+        return 1;
+    }
+    printf("%s: %zu assets, %.1f MiB, %zu skipped\n",
+           output.c_str(),
+           entries.size(),
+           offset / 1048576.0,
+           failed);
+    return 0;
+}
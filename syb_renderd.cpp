@@ -0,0 +1,401 @@
+/*
+ * sayobot-renderd：独立的渲染进程，在 Unix 域套接字上接受渲染请求（协议见 syb_client.h），
+ * 一张卡片的崩溃或卡顿不会影响调用方的进程
+ * 用法:
+ *** sayobot-renderd -s 套接字 [-w 进程数] [--path 键=值]... [--font 键=值]... [--cache 键=字节数]...
+ ***                 [--bundle 素材包] [--avatars 头像库] [--scale 比例] [--preload]
+ * 主进程设置好上下文（映射素材包和头像库，--preload 时预先解码素材、加载字体）后 fork 出工作进程，
+ * --scale 不为1时素材包要用同一比例打包（syb_pack --scale），否则贴图仍然要解码；
+ * 这些页面在工作进程间写时复制共享；工作进程各自 accept 同一个监听套接字，
+ * 每个连接上的请求按顺序渲染，可以连续发送多个请求（流水线）
+ * 工作进程退出（包括崩溃）后由主进程重新启动；主进程收到 SIGTERM/SIGINT 时结束所有工作进程
+ * 套接字只有运行服务的用户可以连接（0600），其他用户的进程需要经由同一用户的代理；
+ * 请求中的扁平数据由 Sayobot_FlatPanel 的校验检查（字符串长度、必需的字段），服务本身只检查帧格式
+ */
+#include "syb.cpp"
+#include "syb_client.h"
+
+#include <errno.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdio.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#ifdef __linux__
+#include <sys/prctl.h>
+#endif
+
+#include <map>
+
+namespace
+{
+    volatile sig_atomic_t stopping = 0;
+
+    void OnStop(int)
+    {
+        stopping = 1;
+    }
+
+    // 一个客户端连接：未解析的输入和未发送的输出
+    struct Connection {
+        int fd;
+        std::string in, out;
+        size_t sent = 0;
+        bool closing = false; // 对方已关闭写端，处理完剩余的请求、发送完响应后关闭
+    };
+
+    // 输出积压超过这个大小时暂停读取该连接的请求
+    const size_t kMaxPending = 32 << 20;
+
+    void AppendFrame(std::string& out, uint32_t id, int32_t code, const void* data, size_t len)
+    {
+        Sayobot_Frame frame;
+        frame.magic = SAYOBOT_FRAME_MAGIC;
+        frame.id = id;
+        frame.code = code;
+        frame.length = (uint32_t)len;
+        out.append((const char*)&frame, sizeof(frame));
+        out.append((const char*)data, len);
+    }
+
+    void AppendError(std::string& out, uint32_t id, int32_t code, const std::string& message)
+    {
+        AppendFrame(out, id, code, message.data(), message.size());
+    }
+
+    // 处理一个完整的请求帧，响应追加到 out
+    void Handle(Sayobot_Context* ctx, const Sayobot_Frame& frame, const char* payload,
+                std::string& out)
+    {
+        if (frame.code == SAYOBOT_FRAME_PING)
+        {
+            const std::string pong = "pong " + std::to_string(getpid());
+            AppendFrame(out, frame.id, SAYOBOT_OK, pong.data(), pong.size());
+            return;
+        }
+        if (frame.code != SAYOBOT_FRAME_RENDER)
+        {
+            AppendError(out, frame.id, SAYOBOT_EINVAL, "unknown request type");
+            return;
+        }
+        const size_t format_len = strnlen(payload, std::min<size_t>(frame.length, SAYOBOT_FRAME_FORMAT_MAX));
+        if (format_len == frame.length || format_len == SAYOBOT_FRAME_FORMAT_MAX)
+        {
+            AppendError(out, frame.id, SAYOBOT_EINVAL, "missing format");
+            return;
+        }
+        unsigned char* data;
+        size_t len;
+        // 扁平数据直接在接收缓冲区中使用，不复制
+        const int status = Sayobot_CtxMakePersonalCardFlatToMemory(ctx,
+                                                                   payload + format_len + 1,
+                                                                   frame.length - format_len - 1,
+                                                                   payload,
+                                                                   &data,
+                                                                   &len);
+        if (status != SAYOBOT_OK)
+        {
+            AppendError(out, frame.id, status, "render failed");
+            return;
+        }
+        AppendFrame(out, frame.id, SAYOBOT_OK, data, len);
+        Sayobot_FreeBuffer(data);
+    }
+
+    // in 的开头是否有 Process 可以处理的帧：完整的帧，或者会被判为协议错误的帧头
+    bool HasFrame(const std::string& in)
+    {
+        if (in.size() < sizeof(Sayobot_Frame))
+            return false;
+        Sayobot_Frame frame;
+        memcpy(&frame, in.data(), sizeof(frame));
+        return frame.magic != SAYOBOT_FRAME_MAGIC || frame.length > SAYOBOT_FRAME_MAX
+               || in.size() - sizeof(frame) >= frame.length;
+    }
+
+    // 解析并处理 in 中所有完整的帧；协议错误时返回false
+    bool Process(Sayobot_Context* ctx, Connection& conn)
+    {
+        size_t pos = 0;
+        while (conn.in.size() - pos >= sizeof(Sayobot_Frame)
+               && conn.out.size() - conn.sent < kMaxPending)
+        {
+            Sayobot_Frame frame;
+            memcpy(&frame, conn.in.data() + pos, sizeof(frame));
+            if (frame.magic != SAYOBOT_FRAME_MAGIC || frame.length > SAYOBOT_FRAME_MAX)
+                return false;
+            if (conn.in.size() - pos - sizeof(frame) < frame.length)
+                break;
+            Handle(ctx, frame, conn.in.data() + pos + sizeof(frame), conn.out);
+            pos += sizeof(frame) + frame.length;
+        }
+        conn.in.erase(0, pos);
+        return true;
+    }
+
+    // 尽量发送积压的输出；连接出错时返回false
+    bool Flush(Connection& conn)
+    {
+        while (conn.sent < conn.out.size())
+        {
+            ssize_t n = send(conn.fd,
+                             conn.out.data() + conn.sent,
+                             conn.out.size() - conn.sent,
+                             MSG_NOSIGNAL | MSG_DONTWAIT);
+            if (n < 0 && errno == EINTR)
+                continue;
+            if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+                return true;
+            if (n <= 0)
+                return false;
+            conn.sent += n;
+        }
+        conn.out.clear();
+        conn.sent = 0;
+        return true;
+    }
+
+    // 工作进程：poll 监听套接字和已接受的连接，依次处理请求
+    void Worker(Sayobot_Context* ctx, int listener, pid_t master)
+    {
+        signal(SIGTERM, SIG_DFL);
+        signal(SIGINT, SIG_DFL);
+#ifdef __linux__
+        prctl(PR_SET_PDEATHSIG, SIGTERM);
+#endif
+        std::vector<Connection> conns;
+        std::vector<pollfd> fds;
+        char buf[65536];
+        while (getppid() == master)
+        {
+            fds.assign(1, pollfd{listener, POLLIN, 0});
+            for (const Connection& conn : conns)
+            {
+                short events = conn.sent < conn.out.size() ? POLLOUT : 0;
+                if (!conn.closing && conn.out.size() - conn.sent < kMaxPending)
+                    events |= POLLIN;
+                fds.push_back(pollfd{conn.fd, events, 0});
+            }
+            if (poll(fds.data(), fds.size(), 1000) < 0)
+            {
+                if (errno == EINTR)
+                    continue;
+                break;
+            }
+            std::vector<Connection> alive;
+            for (size_t i = 0; i < conns.size(); ++i)
+            {
+                Connection& conn = conns[i];
+                bool ok = !(fds[i + 1].revents & (POLLERR | POLLNVAL));
+                if (ok && (fds[i + 1].revents & (POLLIN | POLLHUP)) && !conn.closing)
+                {
+                    ssize_t n = recv(conn.fd, buf, sizeof(buf), MSG_DONTWAIT);
+                    if (n > 0)
+                        conn.in.append(buf, n);
+                    else if (n == 0)
+                        conn.closing = true;
+                    else if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+                        ok = false;
+                }
+                ok = ok && Process(ctx, conn) && Flush(conn);
+                // 因输出积压暂停的请求在输出发送完后继续处理，对方关闭写端后也不丢弃
+                while (ok && conn.sent == conn.out.size() && HasFrame(conn.in))
+                    ok = Process(ctx, conn) && Flush(conn);
+                if (!ok || (conn.closing && conn.sent == conn.out.size() && !HasFrame(conn.in)))
+                    close(conn.fd);
+                else
+                    alive.push_back(std::move(conn));
+            }
+            conns.swap(alive);
+            if (fds[0].revents & POLLIN)
+            {
+                // 其他工作进程可能先接受了连接，此时 accept 返回 EAGAIN
+                int fd = accept(listener, nullptr, nullptr);
+                if (fd >= 0)
+                {
+                    Connection conn;
+                    conn.fd = fd;
+                    conns.push_back(std::move(conn));
+                }
+            }
+        }
+        for (const Connection& conn : conns)
+            close(conn.fd);
+    }
+
+    bool SetOption(Sayobot_Context* ctx, const std::string& kind, const std::string& arg)
+    {
+        const size_t eq = arg.find('=');
+        if (eq == std::string::npos)
+            return false;
+        const std::string key = arg.substr(0, eq), value = arg.substr(eq + 1);
+        if (kind == "--path")
+            return Sayobot_CtxSetPath(ctx, key.c_str(), value.c_str()) != nullptr;
+        if (kind == "--font")
+            return Sayobot_CtxSetFont(ctx, key.c_str(), value.c_str()) != nullptr;
+        return Sayobot_CtxSetCacheSize(ctx, key.c_str(), atoll(value.c_str())) >= 0;
+    }
+
+    void Usage(const char* argv0)
+    {
+        fprintf(stderr,
+                "usage: %s -s SOCKET [-w WORKERS] [--path KEY=VALUE]... [--font KEY=VALUE]... "
+                "[--cache KEY=BYTES]... [--bundle FILE] [--avatars FILE] [--scale S] "
+                "[--preload]\n",
+                argv0);
+    }
+} // namespace
+
+int main(int argc, char** argv)
+{
+    std::string socket_path, bundle, avatars;
+    int workers = 4;
+    double scale = 1.0;
+    bool preload = false;
+    Magick::InitializeMagick(argv[0]);
+    // 并行由工作进程提供，每个进程一次只渲染一张卡片，Magick 内部只用一个线程；
+    // fork 之前也不能有 Magick 的 OpenMP 线程
+    Sayobot_SetThreadPolicy(SAYOBOT_THREADS_NARROW, -1, -1);
+    Sayobot_Context* ctx = Sayobot_CreateContext();
+    for (int i = 1; i < argc; ++i)
+    {
+        const std::string arg = argv[i];
+        const bool has_value = i + 1 < argc;
+        if (arg == "-s" && has_value)
+            socket_path = argv[++i];
+        else if (arg == "-w" && has_value)
+            workers = atoi(argv[++i]);
+        else if ((arg == "--path" || arg == "--font" || arg == "--cache") && has_value)
+        {
+            if (!SetOption(ctx, arg, argv[++i]))
+            {
+                fprintf(stderr, "invalid %s %s\n", arg.c_str(), argv[i]);
+                return 2;
+            }
+        }
+        else if (arg == "--bundle" && has_value)
+            bundle = argv[++i];
+        else if (arg == "--avatars" && has_value)
+            avatars = argv[++i];
+        else if (arg == "--scale" && has_value)
+            scale = atof(argv[++i]);
+        else if (arg == "--preload")
+            preload = true;
+        else
+        {
+            Usage(argv[0]);
+            return 2;
+        }
+    }
+    sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    if (socket_path.empty() || socket_path.size() >= sizeof(addr.sun_path) || workers <= 0
+        || scale <= 0)
+    {
+        Usage(argv[0]);
+        return 2;
+    }
+
+    Sayobot_CtxSetScale(ctx, scale);
+    if (!bundle.empty() && Sayobot_CtxLoadBundle(ctx, bundle.c_str()) < 0)
+    {
+        fprintf(stderr, "cannot load bundle %s\n", bundle.c_str());
+        return 1;
+    }
+    if (!avatars.empty() && Sayobot_CtxOpenAvatars(ctx, avatars.c_str()) < 0)
+    {
+        fprintf(stderr, "cannot open avatar store %s\n", avatars.c_str());
+        return 1;
+    }
+    if (preload)
+    {
+        Sayobot_PreloadReport report;
+        Sayobot_Preload(ctx,
+                        SAYOBOT_PRELOAD_ASSETS | SAYOBOT_PRELOAD_FONTS | SAYOBOT_PRELOAD_WARMUP,
+                        0,
+                        nullptr,
+                        nullptr,
+                        &report);
+        fprintf(stderr,
+                "preloaded %llu assets (%llu failed), %llu fonts in %.1f ms, warmup %d\n",
+                (unsigned long long)report.assets,
+                (unsigned long long)report.assets_failed,
+                (unsigned long long)report.fonts,
+                report.elapsed_us / 1000.0,
+                report.warmup_status);
+    }
+
+    int listener = socket(AF_UNIX, SOCK_STREAM, 0);
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, socket_path.c_str());
+    unlink(socket_path.c_str());
+    // 套接字文件在 bind 时创建，权限为0600：只有运行服务的用户可以连接
+    const mode_t mask = umask(0177);
+    const bool bound = listener >= 0 && bind(listener, (sockaddr*)&addr, sizeof(addr)) == 0;
+    umask(mask);
+    if (!bound || listen(listener, 128) != 0
+        || fcntl(listener, F_SETFL, fcntl(listener, F_GETFL) | O_NONBLOCK) != 0)
+    {
+        perror(socket_path.c_str());
+        return 1;
+    }
+
+    struct sigaction action;
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = OnStop; // 不设置 SA_RESTART，waitpid 会被打断
+    sigaction(SIGTERM, &action, nullptr);
+    sigaction(SIGINT, &action, nullptr);
+    signal(SIGPIPE, SIG_IGN);
+
+    const pid_t master = getpid();
+    std::map<pid_t, std::chrono::steady_clock::time_point> children;
+    auto spawn = [&] {
+        pid_t pid = fork();
+        if (pid == 0)
+        {
+            Worker(ctx, listener, master);
+            _exit(0);
+        }
+        if (pid > 0)
+            children[pid] = std::chrono::steady_clock::now();
+        else
+            perror("fork");
+    };
+    for (int i = 0; i < workers; ++i)
+        spawn();
+    fprintf(stderr, "listening on %s with %d workers\n", socket_path.c_str(), workers);
+
+    while (!stopping)
+    {
+        int status;
+        pid_t pid = waitpid(-1, &status, 0);
+        if (pid < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            break;
+        }
+        auto it = children.find(pid);
+        if (it == children.end())
+            continue;
+        if (!stopping && WIFSIGNALED(status))
+            fprintf(stderr, "worker %d killed by signal %d\n", (int)pid, WTERMSIG(status));
+        // 启动后马上退出的进程（例如配置错误）不要立即重启，避免空转
+        if (std::chrono::steady_clock::now() - it->second < std::chrono::seconds(1))
+            sleep(1);
+        children.erase(it);
+        if (!stopping)
+            spawn();
+    }
+
+    for (const auto& child : children)
+        kill(child.first, SIGTERM);
+    for (const auto& child : children)
+        waitpid(child.first, nullptr, 0);
+    close(listener);
+    unlink(socket_path.c_str());
+    Sayobot_DestroyContext(ctx);
+    return 0;
+}